@@ -1,4 +1,4 @@
-#define _DEFAULT_SOURCE // For useconds_t
+#define _GNU_SOURCE // For ppoll, signalfd and M_PI
 #include <math.h>
 #include <stdio.h>
 #include <string.h>
@@ -7,28 +7,67 @@
 #include <termios.h> // For terminal control
 #include <fcntl.h>   // For fcntl
 #include <errno.h>   // For errno, EAGAIN, EWOULDBLOCK
+#include <time.h>    // For clock_gettime
+#include <poll.h>    // For ppoll
+#include <signal.h>  // For sigprocmask
+#include <sys/signalfd.h> // For signalfd
+#include <sys/ioctl.h> // For TIOCGWINSZ
+#include <pthread.h>   // For the rasterizer worker pool
+#include <stdatomic.h> // For the lock-free frame ring
+#include <stdint.h>    // For uint64_t
+#include <sys/eventfd.h> // For waking the writer thread
+#include <sys/mman.h>    // For mapping the frame cache file
+#include <sys/stat.h>    // For fstat
+#include <sys/epoll.h>   // For the broadcast server's event loop
+#include <sys/socket.h>  // For the broadcast server's sockets
+#include <sys/uio.h>     // For writev
+#include <netinet/in.h>
+#include <netinet/tcp.h> // For TCP_NODELAY
+#include <netdb.h>       // For getnameinfo
+#include "donut_shm.h"   // Layout of the shared memory frame ring
+#if defined(__x86_64__) || defined(__i386__)
+#define HAVE_X86_KERNELS 1
+#include <immintrin.h> // SSE/AVX intrinsics for the vector rasterizers
+#endif
+#if defined(__ARM_NEON) && defined(__aarch64__)
+#define HAVE_NEON_KERNEL 1
+#include <arm_neon.h> // NEON intrinsics for the vector rasterizer
+#endif
 
 // Global variable for the original terminal settings
 struct termios orig_termios;
+int rawMode;      // The terminal is in raw mode
+int rawSuspended; // Raw mode is due once the process is in the foreground again
 
 // Function to disable raw mode and restore terminal settings
 void disableRawMode()
 {
+  if (!rawMode)
+  {
+    return;
+  }
+  rawMode = 0;
   tcsetattr(STDIN_FILENO, TCSAFLUSH, &orig_termios);
-  printf("\x1b[?25h"); // Show cursor again
-  fflush(stdout);      // Ensure the cursor is displayed immediately
+  printf("\x1b[?1004l\x1b[?25h"); // Stop focus reports, show cursor again
+  fflush(stdout);                 // Ensure the cursor is displayed immediately
 }
 
-// Function to enable raw mode (non-canonical, no echo)
+// Function to enable raw mode (non-canonical, no echo). Called again after
+// a job-control stop, when the shell may have changed the settings.
 void enableRawMode()
 {
-  if (tcgetattr(STDIN_FILENO, &orig_termios) == -1)
+  static int registered = 0;
+  if (!rawMode && tcgetattr(STDIN_FILENO, &orig_termios) == -1)
   {
     perror("tcgetattr failed"); // Error message in English
     exit(1);
   }
-  // Register disableRawMode to ensure it's called at program exit
-  atexit(disableRawMode);
+  if (!registered)
+  {
+    // Register disableRawMode to ensure it's called at program exit
+    atexit(disableRawMode);
+    registered = 1;
+  }
 
   struct termios raw = orig_termios;
   // Disable echo, canonical mode, signal characters (Ctrl+C, etc.)
@@ -47,48 +86,184 @@ void enableRawMode()
     perror("tcsetattr failed"); // Error message in English
     exit(1);
   }
-  printf("\x1b[?25l"); // Hide cursor
+  rawMode = 1;
+  // Hide cursor; report focus changes as ESC [ I and ESC [ O
+  printf("\x1b[?25l\x1b[?1004h");
   fflush(stdout);
 }
 
+// Returns 1 unless the terminal on stdin belongs to another process group,
+// as after a stop and 'bg' or when started with '&'
+int inForeground()
+{
+  pid_t group = tcgetpgrp(STDIN_FILENO);
+  return group == -1 || group == getpgrp();
+}
+
+// Takes the terminal back after the process was continued: raw mode again
+// if suspendProcess() ended it or the shell reset it meanwhile. Returns 0
+// while another job owns the terminal, which must then be left alone.
+int resumeTerminal()
+{
+  if (!inForeground())
+  {
+    return 0;
+  }
+  if (rawMode || rawSuspended)
+  {
+    rawSuspended = 0;
+    enableRawMode();
+  }
+  return 1;
+}
+
+// Luminance indices 0..LUMINANCE_LEVELS-1 pick a character of the ramp.
+// Every torus of a scene has one of up to MAX_PALETTES palettes, and a
+// shade is palette * LUMINANCE_LEVELS + luminance.
+#define LUMINANCE_RAMP ".,-~:;=!*#$@"
+#define LUMINANCE_LEVELS 12
+#define MAX_PALETTES 7 // One per color name
+#define MAX_SHADES (MAX_PALETTES * LUMINANCE_LEVELS)
+
+// The rasterizers keep one 32-bit word per point of the raster grid: the
+// inverse depth D = 1 / (z + 5) of the nearest sample in units of
+// 2^-DEPTH_BITS above DEPTH_SHIFT and its luminance index below, so the
+// depth test is one unsigned compare and the nearer, then brighter, sample
+// wins whatever the order. D stays below 0.5 as the torus comes no closer
+// than 2 units; rays stopping just short of the surface are clamped. The
+// low LUMINANCE_BITS hold the luminance, the bits above the palette. 0 is a
+// point without a sample.
+#define DEPTH_BITS 17
+#define DEPTH_SHIFT 16
+#define DEPTH_MAX 0xFFFF
+#define DEPTH_SCALE (float)(1 << DEPTH_BITS)
+#define LUMINANCE_BITS 4
+
+static inline uint32_t depthWord(float D, int N)
+{
+  float q = D * DEPTH_SCALE;
+  return (uint32_t)(q < DEPTH_MAX ? q : DEPTH_MAX) << DEPTH_SHIFT | (uint32_t)N;
+}
+
+static inline int depthLuminance(uint32_t w)
+{
+  return (int)(w & ((1 << LUMINANCE_BITS) - 1));
+}
+
+static inline int depthShade(uint32_t w)
+{
+  int palette = (int)(w >> LUMINANCE_BITS & ((1 << (DEPTH_SHIFT - LUMINANCE_BITS)) - 1));
+  return palette * LUMINANCE_LEVELS + depthLuminance(w);
+}
+
+// How the raster grid maps to terminal cells: one point per cell drawn with
+// the luminance ramp, two stacked points per half-block cell (the upper in
+// the foreground, the lower in the background color) or 2x4 braille dots
+// per cell. The last two show luminance as color shades.
+enum
+{
+  MODE_CELLS,
+  MODE_HALF,
+  MODE_BRAILLE,
+  MODE_COUNT
+};
+
+typedef struct
+{
+  const char *name;
+  int subX, subY; // Raster points per cell
+  int cellBytes;  // Most output bytes per cell: the longest escape and glyph
+} RenderMode;
+
+const RenderMode renderModes[MODE_COUNT] = {{"cells", 1, 1, 21}, {"half", 1, 2, 40}, {"braille", 2, 4, 23}};
+
+// Framebuffer cells hold a code for what the cell shows, 0 for blank. In
+// the cells mode it is 1 + shade, in the half-block mode (shades + 1) *
+// upper + lower (each 1 + shade or 0 if empty) and in the braille mode the
+// dot mask plus 256 times the shade: the palette of the nearest dot and the
+// mean luminance of the dots set. With one palette, shades is 12.
+typedef unsigned short Cell;
+#define CELL_CODES (MAX_SHADES << 8)
+#define CELL_STATES (MAX_SHADES * MAX_SHADES + 2) // Color states: every half-block color pair and the blanks
+
+// Terminal output for every possible cell code, built for the palettes by
+// buildCellTable() so the encoders only look up and copy. Every code has a
+// color state, whose escape sets the colors it needs; state 0 keeps the
+// current colors and has no escape.
+typedef struct
+{
+  char escape[CELL_STATES][40];         // Escape of each color state
+  unsigned char escapeLen[CELL_STATES]; // Its length
+  short state[CELL_CODES];              // Color state of the cell
+  char glyph[CELL_CODES][4];            // UTF-8 character drawn for the cell
+  unsigned char glyphLen[CELL_CODES];
+  unsigned codepoint[CELL_CODES];       // Its Unicode code point
+  int shades;                           // Palettes times LUMINANCE_LEVELS
+  int crlf;                             // Rows end in CR LF, for clients without tty output processing
+} CellTable;
+
+// Colors of the 3 intensity levels, and the closest base color for
+// terminals with only 16 colors
+typedef struct
+{
+  unsigned char rgb[3][3]; // Dark, medium and light (highlight) color
+  int ansi;                // ANSI color number 0..7
+} Palette;
+
+// Color escapes the output can use, from the largest to the smallest
+enum
+{
+  DEPTH_TRUECOLOR,
+  DEPTH_256,
+  DEPTH_16,
+  DEPTH_COUNT
+};
+const char *depthNames[DEPTH_COUNT] = {"truecolor", "256", "16"};
+
 // Function to set the color palette based on the name
-void setColorPalette(const char *colorName, const char **palette)
+void setColorPalette(const char *colorName, Palette *palette)
 {
   if (strcmp(colorName, "rot") == 0 || strcmp(colorName, "red") == 0)
   {
-    palette[0] = "\x1b[38;2;100;0;0m";     // Dark Red
-    palette[1] = "\x1b[38;2;180;0;0m";     // Medium Red
-    palette[2] = "\x1b[38;2;255;100;100m"; // Light Red (Highlight)
+    *palette = (Palette){{{100, 0, 0},      // Dark Red
+                          {180, 0, 0},      // Medium Red
+                          {255, 100, 100}}, // Light Red (Highlight)
+                         1};                // ANSI red
   }
   else if (strcmp(colorName, "blau") == 0 || strcmp(colorName, "blue") == 0)
   {
-    palette[0] = "\x1b[38;2;0;0;100m";     // Dark Blue
-    palette[1] = "\x1b[38;2;0;0;180m";     // Medium Blue
-    palette[2] = "\x1b[38;2;100;100;255m"; // Light Blue (Highlight)
+    *palette = (Palette){{{0, 0, 100},      // Dark Blue
+                          {0, 0, 180},      // Medium Blue
+                          {100, 100, 255}}, // Light Blue (Highlight)
+                         4};                // ANSI blue
   }
   else if (strcmp(colorName, "cyan") == 0)
   {
-    palette[0] = "\x1b[38;2;0;100;100m";   // Dark Cyan
-    palette[1] = "\x1b[38;2;0;180;180m";   // Medium Cyan
-    palette[2] = "\x1b[38;2;100;255;255m"; // Light Cyan (Highlight)
+    *palette = (Palette){{{0, 100, 100},    // Dark Cyan
+                          {0, 180, 180},    // Medium Cyan
+                          {100, 255, 255}}, // Light Cyan (Highlight)
+                         6};                // ANSI cyan
   }
   else if (strcmp(colorName, "magenta") == 0)
   {
-    palette[0] = "\x1b[38;2;100;0;100m";   // Dark Magenta
-    palette[1] = "\x1b[38;2;180;0;180m";   // Medium Magenta
-    palette[2] = "\x1b[38;2;255;100;255m"; // Light Magenta (Highlight)
+    *palette = (Palette){{{100, 0, 100},    // Dark Magenta
+                          {180, 0, 180},    // Medium Magenta
+                          {255, 100, 255}}, // Light Magenta (Highlight)
+                         5};                // ANSI magenta
   }
   else if (strcmp(colorName, "gelb") == 0 || strcmp(colorName, "yellow") == 0)
   {
-    palette[0] = "\x1b[38;2;100;100;0m";   // Dark Yellow
-    palette[1] = "\x1b[38;2;180;180;0m";   // Medium Yellow
-    palette[2] = "\x1b[38;2;255;255;100m"; // Light Yellow (Highlight)
+    *palette = (Palette){{{100, 100, 0},    // Dark Yellow
+                          {180, 180, 0},    // Medium Yellow
+                          {255, 255, 100}}, // Light Yellow (Highlight)
+                         3};                // ANSI yellow
   }
   else if (strcmp(colorName, "weiss") == 0 || strcmp(colorName, "white") == 0)
   {
-    palette[0] = "\x1b[38;2;100;100;100m"; // Dark Gray
-    palette[1] = "\x1b[38;2;180;180;180m"; // Gray
-    palette[2] = "\x1b[38;2;255;255;255m"; // White (Highlight)
+    *palette = (Palette){{{100, 100, 100},  // Dark Gray
+                          {180, 180, 180},  // Gray
+                          {255, 255, 255}}, // White (Highlight)
+                         7};                // ANSI white
   }
   // Default/Fallback: Green
   else
@@ -97,157 +272,6017 @@ void setColorPalette(const char *colorName, const char **palette)
     { // Also allow "green"
       fprintf(stderr, "Warning: Unknown color '%s'. Using default 'green'.\nAvailable: green, red, blue, cyan, magenta, yellow, white\n", colorName);
     }
-    palette[0] = "\x1b[38;2;0;100;0m";     // Dark Green
-    palette[1] = "\x1b[38;2;0;180;0m";     // Medium Green
-    palette[2] = "\x1b[38;2;100;255;100m"; // Light Green (Highlight)
+    *palette = (Palette){{{0, 100, 0},      // Dark Green
+                          {0, 180, 0},      // Medium Green
+                          {100, 255, 100}}, // Light Green (Highlight)
+                         2};                // ANSI green
   }
 }
 
-int main(int argc, char *argv[])
+// Returns the xterm 256-color index closest to an RGB color: a point of
+// the 6x6x6 color cube or one of the 24 grays
+int color256(const unsigned char *rgb)
 {
-  // Default values
-  const char *colorName = "gruen"; // Default color
-  float speedFactor = 1.0f;
-  long baseSleep = 33333; // Base sleep time in microseconds (approx. 30 FPS)
+  static const int cube[6] = {0, 95, 135, 175, 215, 255};
+  int index = 16, error = 0;
+  for (int c = 0; c < 3; c++)
+  {
+    int step = rgb[c] < 48 ? 0 : rgb[c] < 115 ? 1 : (rgb[c] - 35) / 40;
+    index += step * (c == 0 ? 36 : c == 1 ? 6 : 1);
+    error += (rgb[c] - cube[step]) * (rgb[c] - cube[step]);
+  }
+  int mean = (rgb[0] + rgb[1] + rgb[2]) / 3;
+  int gray = mean < 8 ? 0 : mean > 238 ? 23 : (mean - 8 + 5) / 10;
+  int grayError = 0;
+  for (int c = 0; c < 3; c++)
+  {
+    grayError += (rgb[c] - (8 + 10 * gray)) * (rgb[c] - (8 + 10 * gray));
+  }
+  return grayError < error ? 232 + gray : index;
+}
 
-  // Process arguments
-  if (argc > 1)
+// SGR parameters of the foreground (or background) color for luminance
+// lum. The cells mode, and every mode at 16 colors, uses the three palette
+// colors: ".,-" dark, "~:;=" medium and "!*#$@" light. The other modes
+// blend between them, one shade per luminance. With 16 colors the levels
+// become faint, normal and bright variants of the base color.
+static void colorParams(const Palette *palette, int depth, int mode, int lum, int background, char *out, size_t size)
+{
+  int level = lum < 3 ? 0 : lum < 7 ? 1 : 2;
+  if (depth == DEPTH_16)
   {
-    // Show help?
-    if (strcmp(argv[1], "-h") == 0 || strcmp(argv[1], "--help") == 0)
-    {
-      printf("Usage: %s [color] [speed]\n", argv[0]);
-      printf("Press 'q' or ESC to quit.\n\n");
-      printf("Arguments:\n");
-      printf("  color          Color name (optional, default: green).\n");
-      printf("                 Available: green, red, blue, cyan, magenta, yellow, white\n"); // English names
-      printf("  speed          Positive speed factor (optional, default: 1.0).\n");
-      printf("                 > 1.0: faster, < 1.0: slower.\n");
-      return 0;
+    if (background)
+    {
+      snprintf(out, size, "%d", (level == 2 ? 100 : 40) + palette->ansi);
+    }
+    else
+    {
+      snprintf(out, size, "%s;%d", level == 0 ? "2" : "22", (level == 2 ? 90 : 30) + palette->ansi);
+    }
+    return;
+  }
+  unsigned char rgb[3];
+  float blend = 2.0f * lum / (LUMINANCE_LEVELS - 1);
+  int from = blend < 1 ? 0 : 1;
+  for (int c = 0; c < 3; c++)
+  {
+    rgb[c] = mode == MODE_CELLS ? palette->rgb[level][c]
+                                : (unsigned char)lrintf(palette->rgb[from][c] + (blend - from) *
+                                                                                    (palette->rgb[from + 1][c] - palette->rgb[from][c]));
+  }
+  if (depth == DEPTH_TRUECOLOR)
+  {
+    snprintf(out, size, "%d;2;%d;%d;%d", background ? 48 : 38, rgb[0], rgb[1], rgb[2]);
+  }
+  else
+  {
+    snprintf(out, size, "%d;5;%d", background ? 48 : 38, color256(rgb));
+  }
+}
+
+// Returns the color state with the given SGR parameters, adding it if
+// needed. States with the same escape (possible with fewer colors) are
+// shared, so switching between them costs nothing. index is an open
+// addressing hash of the states so far (0: free slot), as there are
+// thousands with several palettes.
+#define CELL_HASH 16384 // Power of two above twice CELL_STATES
+static int cellState(CellTable *cells, int *count, short *index, const char *params)
+{
+  char escape[40];
+  int len = snprintf(escape, sizeof(escape), "\x1b[%sm", params);
+  unsigned h = 2166136261u;
+  for (int i = 0; i < len; i++)
+  {
+    h = (h ^ (unsigned char)escape[i]) * 16777619u;
+  }
+  for (h &= CELL_HASH - 1; index[h] != 0; h = (h + 1) & (CELL_HASH - 1))
+  {
+    int s = index[h];
+    if (cells->escapeLen[s] == len && memcmp(cells->escape[s], escape, len) == 0)
+    {
+      return s;
+    }
+  }
+  memcpy(cells->escape[*count], escape, len);
+  cells->escapeLen[*count] = len;
+  index[h] = (short)*count;
+  return (*count)++;
+}
+
+// Stores the code point u and its UTF-8 encoding as the glyph of code c
+static void cellGlyph(CellTable *cells, int c, unsigned u)
+{
+  char *g = cells->glyph[c];
+  cells->codepoint[c] = u;
+  if (u < 0x80)
+  {
+    g[0] = u;
+    cells->glyphLen[c] = 1;
+  }
+  else
+  {
+    g[0] = 0xE0 | u >> 12, g[1] = 0x80 | (u >> 6 & 0x3F), g[2] = 0x80 | (u & 0x3F);
+    cells->glyphLen[c] = 3;
+  }
+}
+
+// Builds the cell table for count palettes at the given color depth and
+// mode
+void buildCellTable(const Palette *palettes, int count, int depth, int mode, CellTable *cells)
+{
+  static char fg[MAX_SHADES][24], bg[MAX_SHADES][24];
+  char params[48];
+  int shades = count * LUMINANCE_LEVELS;
+  for (int shade = 0; shade < shades; shade++)
+  {
+    const Palette *palette = &palettes[shade / LUMINANCE_LEVELS];
+    colorParams(palette, depth, mode, shade % LUMINANCE_LEVELS, 0, fg[shade], sizeof(fg[shade]));
+    colorParams(palette, depth, mode, shade % LUMINANCE_LEVELS, 1, bg[shade], sizeof(bg[shade]));
+  }
+  memset(cells, 0, sizeof(*cells));
+  cells->shades = shades;
+  int states = 1;
+  short index[CELL_HASH] = {0};
+  for (int c = 0; c < CELL_CODES; c++)
+  {
+    cellGlyph(cells, c, ' '); // Blank (and unused) codes
+  }
+
+  if (mode == MODE_CELLS)
+  {
+    for (int shade = 0; shade < shades; shade++)
+    {
+      cells->state[1 + shade] = cellState(cells, &states, index, fg[shade]);
+      cellGlyph(cells, 1 + shade, LUMINANCE_RAMP[shade % LUMINANCE_LEVELS]);
     }
-    colorName = argv[1];
   }
-  if (argc > 2)
+  else if (mode == MODE_HALF)
   {
-    char *endptr;
-    speedFactor = strtof(argv[2], &endptr);
-    // Check if conversion was successful and the value is positive
-    if (*endptr != '\0' || speedFactor <= 0)
+    // Blanks reset the background, which the other cells may have set
+    int blank = cellState(cells, &states, index, "49");
+    for (int upper = 0; upper <= shades; upper++)
     {
-      fprintf(stderr, "Warning: Invalid speed factor '%s'. Must be a positive number. Using default 1.0.\n", argv[2]);
-      speedFactor = 1.0f;
+      for (int lower = 0; lower <= shades; lower++)
+      {
+        int c = (shades + 1) * upper + lower;
+        if (upper == 0 && lower == 0)
+        {
+          cells->state[c] = blank;
+          continue;
+        }
+        if (upper == 0 || lower == 0 || upper == lower)
+        {
+          // One color: upper or lower half block, or a full block
+          snprintf(params, sizeof(params), "%s;49", fg[(upper ? upper : lower) - 1]);
+          cellGlyph(cells, c, upper == lower ? 0x2588 : upper ? 0x2580 : 0x2584);
+        }
+        else
+        {
+          snprintf(params, sizeof(params), "%s;%s", fg[upper - 1], bg[lower - 1]);
+          cellGlyph(cells, c, 0x2580);
+        }
+        cells->state[c] = cellState(cells, &states, index, params);
+      }
     }
   }
-  if (argc > 3)
+  else
   {
-    fprintf(stderr, "Warning: Too many arguments. Use '%s --help' for help.\n", argv[0]);
-    // Optional: Exit with error here or simply ignore
-    // return 1;
+    for (int shade = 0; shade < shades; shade++)
+    {
+      int state = cellState(cells, &states, index, fg[shade]);
+      for (int mask = 1; mask < 256; mask++)
+      {
+        cells->state[shade << 8 | mask] = state;
+        cellGlyph(cells, shade << 8 | mask, 0x2800 + mask);
+      }
+    }
   }
+}
+
+// Number of cell codes buildCellTable() defines for the mode and shades;
+// all codes below it are valid indices of the table
+int cellCodes(int mode, int shades)
+{
+  return mode == MODE_CELLS ? 1 + shades : mode == MODE_HALF ? (shades + 1) * (shades + 1) : shades << 8;
+}
 
-  // Set color palette based on name (accepts German/English names)
-  const char *colorPalette[3]; // Array for 3 intensity levels
-  setColorPalette(colorName, colorPalette);
+// Torus sample points in object space as structure of arrays. The point for
+// ring angle j and circle angle i is ((2 + cos j) cos i, (2 + cos j) sin i,
+// sin j) and its unit normal is (cos j cos i, cos j sin i, sin j).
+typedef struct
+{
+  int count;           // Number of sample points
+  int rings;           // Number of rings, stored one after another
+  float *px, *py, *pz; // Positions
+  float *nx, *ny, *nz; // Surface normals
+  // The same in fixed point for rasterFixed(), and its reciprocal table
+  int *ipx, *ipy, *ipz, *inx, *iny, *inz;
+  int *recip;
+} TorusGeometry;
 
-  // Terminal setup for non-blocking input
-  enableRawMode();
+// Fixed-point formats: positions and normals have FIXED_POS_BITS fraction
+// bits, the rotation matrix FIXED_MAT_BITS, the rotation scaled to raster
+// points FIXED_PROJ_BITS, the lights FIXED_LIGHT_BITS and the inverse depth
+// FIXED_D_BITS. The reciprocal table covers z + 5 from 1.5 to 8.5 (the
+// torus reaches 3 units from its center) in steps of 2^RECIP_STEP_BITS
+// units of the position format, 1/256.
+#define FIXED_POS_BITS 28
+#define FIXED_MAT_BITS 30
+#define FIXED_PROJ_BITS 20
+#define FIXED_LIGHT_BITS 26
+#define FIXED_D_BITS 30
+#define RECIP_STEP_BITS 20
+#define RECIP_BASE (3 << (FIXED_POS_BITS - 1))
+#define RECIP_SIZE ((7 << (FIXED_POS_BITS - RECIP_STEP_BITS)) + 2)
 
-  float A = 0, B = 0, i, j, z[1760];
-  char b[1760];
-  printf("\x1b[2J"); // Clear screen (cursor is hidden in enableRawMode)
+// Samples around the circle of ring angle j, at most step apart
+static int ringSamples(float j, float step)
+{
+  int n = (int)ceilf(2 * M_PI * (2 + cosf(j)) / step);
+  return n < 8 ? 8 : n;
+}
 
-  int quit = 0;
-  while (!quit) // Main loop, until quit != 0
+// Samples the torus for a projection scale of the given cells per unit at
+// depth 1. The steps are chosen so that neighbouring samples are at most
+// 1 / density cells apart on screen where the torus is nearest (z + 5 = 2),
+// which leaves no holes at density 1 without oversampling; the circles
+// around the axis get fewer samples towards the inner side, where they are
+// shorter. Density 0 keeps the classic fixed steps (0.07 along the ring,
+// 0.02 around the circle). Returns -1 if out of memory.
+int buildTorusGeometry(TorusGeometry *g, float scale, float density)
+{
+  float step = density > 0 ? 1 / (density * scale * 0.5f) : 0; // Surface distance per step
+  int rings = 0, count = 0;
+  if (density > 0)
   {
-    // Check input non-blockingly
-    char input_char = '\0'; // Initialize
-    ssize_t bytes_read = read(STDIN_FILENO, &input_char, 1);
+    rings = (int)ceilf(2 * M_PI / step);
+    rings = rings < 8 ? 8 : rings;
+    for (int r = 0; r < rings; r++)
+    {
+      count += ringSamples(2 * M_PI * r / rings, step);
+    }
+  }
+  else
+  {
+    int steps = 0;
+    for (float j = 0; 6.28 > j; j += 0.07)
+    {
+      rings++;
+    }
+    for (float i = 0; 6.28 > i; i += 0.02)
+    {
+      steps++;
+    }
+    count = rings * steps;
+  }
+
+  g->count = count;
+  g->rings = rings;
+  size_t floats = 6 * sizeof(float) * (size_t)g->count, ints = 6 * sizeof(int) * (size_t)g->count;
+  float *block = malloc(floats + ints + sizeof(int) * RECIP_SIZE);
+  if (block == NULL)
+  {
+    return -1;
+  }
+  g->px = block;
+  g->py = g->px + g->count;
+  g->pz = g->py + g->count;
+  g->nx = g->pz + g->count;
+  g->ny = g->nx + g->count;
+  g->nz = g->ny + g->count;
+  g->ipx = (int *)(g->nz + g->count);
+  g->ipy = g->ipx + g->count;
+  g->ipz = g->ipy + g->count;
+  g->inx = g->ipz + g->count;
+  g->iny = g->inx + g->count;
+  g->inz = g->iny + g->count;
+  g->recip = (int *)(g->inz + g->count);
 
-    if (bytes_read == 1)
+  int k = 0;
+  float j = 0;
+  for (int r = 0; r < rings; r++)
+  { // Outer ring (torus rotation j)
+    if (density > 0)
     {
-      if (input_char == 'q' || input_char == 'Q' || input_char == 27)
-      {           // 27 is ESC
-        quit = 1; // Signal to exit the loop
-        continue; // Skip the rest of the loop
+      j = 2 * M_PI * r / rings;
+    }
+    float d = cos(j), f = sin(j), h = d + 2;
+    int samples = density > 0 ? ringSamples(j, step) : count / rings;
+    float i = 0;
+    for (int s = 0; s < samples; s++)
+    { // Inner ring (circle rotation i)
+      if (density > 0)
+      {
+        i = 2 * M_PI * s / samples;
       }
+      float c = sin(i), l = cos(i);
+      g->px[k] = l * h;
+      g->py[k] = c * h;
+      g->pz[k] = f;
+      g->nx[k] = l * d;
+      g->ny[k] = c * d;
+      g->nz[k] = f;
+      k++;
+      i += 0.02; // Classic steps, accumulated as in the original loops
+    }
+    j += 0.07;
+  }
+
+  const float one = 1 << FIXED_POS_BITS;
+  for (k = 0; k < g->count; k++)
+  {
+    g->ipx[k] = (int)lrintf(g->px[k] * one), g->ipy[k] = (int)lrintf(g->py[k] * one);
+    g->ipz[k] = (int)lrintf(g->pz[k] * one), g->inx[k] = (int)lrintf(g->nx[k] * one);
+    g->iny[k] = (int)lrintf(g->ny[k] * one), g->inz[k] = (int)lrintf(g->nz[k] * one);
+  }
+  for (int r = 0; r < RECIP_SIZE; r++)
+  {
+    // 1 / (z + 5) in Q30 at the start of each step
+    g->recip[r] = (int)lrint((double)(1 << FIXED_D_BITS) * one / (RECIP_BASE + (double)r * (1 << RECIP_STEP_BITS)));
+  }
+  return 0;
+}
+
+void freeTorusGeometry(TorusGeometry *g)
+{
+  free(g->px);
+  g->px = NULL;
+  g->count = 0;
+}
+
+// Builds the row-major rotation matrix for angle A around the x axis
+// followed by angle B around the z axis
+void rotationMatrix(float A, float B, float *m)
+{
+  float e = sin(A), g = cos(A), n = sin(B), v = cos(B);
+  m[0] = v, m[1] = -n * g, m[2] = n * e;
+  m[3] = n, m[4] = v * g, m[5] = -v * e;
+  m[6] = 0, m[7] = e, m[8] = g;
+}
+
+// What the kernels get to place a torus in view space: the rotation times
+// the scale in m[0..8] (row-major), the position of the center in
+// m[9..11] and the scale in m[12]. The classic torus has scale 1 and sits
+// at (0, 0, 5).
+#define TRANSFORM_SIZE 13
+
+// Framebuffer size and projection onto it. Column 0 holds the line break and
+// row 0 stays blank, as in the classic output layout.
+typedef struct
+{
+  int width, height;    // Framebuffer size in cells
+  float cx, cy, sx, sy; // Projection center and scale in cells
+} Viewport;
+
+// Block of cells [x0, x1) x [y0, y1); empty if x0 >= x1
+typedef struct
+{
+  int x0, y0, x1, y1;
+} Rect;
+
+#define RECT_EMPTY ((Rect){0, 0, 0, 0})
+
+Rect rectUnion(Rect a, Rect b)
+{
+  if (a.x0 >= a.x1)
+  {
+    return b;
+  }
+  if (b.x0 >= b.x1)
+  {
+    return a;
+  }
+  return (Rect){a.x0 < b.x0 ? a.x0 : b.x0, a.y0 < b.y0 ? a.y0 : b.y0,
+                a.x1 > b.x1 ? a.x1 : b.x1, a.y1 > b.y1 ? a.y1 : b.y1};
+}
+
+// Cells the torus can cover with transform m. It lies within the prism of
+// the TORUS_BOUND_SIDES-gon around its outer rim (radius 3) from z = -1 to
+// 1, all in front of the viewer, so the projected corners of the prism
+// enclose its image. One cell of margin covers the rounding of the kernels
+// and the hit distance of the raycast engine. Clamped to the drawable
+// points of the raster grid.
+#define TORUS_BOUND_SIDES 16
+
+Rect torusBounds(const float *m, const Viewport *v)
+{
+  float x0 = INFINITY, y0 = INFINITY, x1 = -INFINITY, y1 = -INFINITY;
+  float radius = 3 / cosf(M_PI / TORUS_BOUND_SIDES); // Polygon around the circle
+  for (int corner = 0; corner < 2 * TORUS_BOUND_SIDES; corner++)
+  {
+    float angle = 2 * M_PI * (corner >> 1) / TORUS_BOUND_SIDES;
+    float px = radius * cosf(angle), py = radius * sinf(angle), pz = corner & 1 ? 1 : -1;
+    float wx = m[0] * px + m[1] * py + m[2] * pz + m[9],
+          wy = m[3] * px + m[4] * py + m[5] * pz + m[10],
+          wz = m[6] * px + m[7] * py + m[8] * pz,
+          D = 1 / (wz + m[11]);
+    float x = v->cx + v->sx * D * wx, y = v->cy + v->sy * D * wy;
+    x0 = fminf(x0, x), x1 = fmaxf(x1, x);
+    y0 = fminf(y0, y), y1 = fmaxf(y1, y);
+  }
+  Rect r = {(int)floorf(x0) - 1, (int)floorf(y0) - 1, (int)floorf(x1) + 2, (int)floorf(y1) + 2};
+  r.x0 = r.x0 < 1 ? 1 : r.x0, r.y0 = r.y0 < 1 ? 1 : r.y0;
+  r.x1 = r.x1 > v->width ? v->width : r.x1, r.y1 = r.y1 > v->height ? v->height : r.y1;
+  return r.x0 < r.x1 && r.y0 < r.y1 ? r : RECT_EMPTY;
+}
+
+// Directional lights. The renderer holds them in view space, each a vector
+// of length sqrt(2) towards the light, so that one light alone reaches the
+// brightest luminance (8 * sqrt(2) is 11) as the classic light (0, -1, -1)
+// does. The kernels get them rotated into object space and scaled by 8,
+// together with the palette of the torus they draw.
+#define MAX_LIGHTS 8
+
+typedef struct
+{
+  int count;
+  float dir[MAX_LIGHTS][3];
+  uint32_t tag; // Palette bits of the depth words (above LUMINANCE_BITS), in object space
+} Lighting;
+
+// Rotates the view-space lights back by rotation m for the samples of a
+// torus drawn with the given palette: n . (M^T l) = (M n) . l, so a normal
+// is only dotted with the lights and never rotated
+void lightingToObject(const Lighting *view, const float *m, int palette, Lighting *object)
+{
+  object->count = view->count;
+  object->tag = (uint32_t)palette << LUMINANCE_BITS;
+  for (int l = 0; l < view->count; l++)
+  {
+    const float *d = view->dir[l];
+    for (int i = 0; i < 3; i++)
+    {
+      object->dir[l][i] = 8 * (m[i] * d[0] + m[3 + i] * d[1] + m[6 + i] * d[2]);
     }
-    else if (bytes_read == -1 && errno != EAGAIN && errno != EWOULDBLOCK)
+  }
+}
+
+// Luminance index of object-space normal n, the lights facing it add up,
+// tagged with the palette
+static inline int shade(const Lighting *light, float nx, float ny, float nz)
+{
+  float sum = 0;
+  for (int l = 0; l < light->count; l++)
+  {
+    const float *d = light->dir[l];
+    float dot = d[0] * nx + d[1] * ny + d[2] * nz;
+    sum += dot > 0 ? dot : 0;
+  }
+  int N = sum;
+  return (N < LUMINANCE_LEVELS - 1 ? N : LUMINANCE_LEVELS - 1) | (int)light->tag;
+}
+
+// Signature shared by all rasterizer kernels; m is a transform
+// (TRANSFORM_SIZE) and light is in object space
+typedef void (*RasterKernel)(const TorusGeometry *g, const float *m, const Lighting *light, const Viewport *v,
+                             uint32_t *depth);
+
+// Depth tests passed by the calling thread's kernels, for the statistics.
+// Only the rare stores pay for it; rendererRasterize() collects it per
+// worker.
+_Thread_local unsigned long rasterPasses;
+
+// Rotates sample k, projects it to the raster point x, y and returns its
+// inverse depth
+static inline float projectSample(const TorusGeometry *g, const float *m, const Viewport *v, int k, int *x, int *y)
+{
+  float px = g->px[k], py = g->py[k], pz = g->pz[k];
+  // Rotated, scaled and moved position
+  float wx = m[0] * px + m[1] * py + m[2] * pz + m[9],
+        wy = m[3] * px + m[4] * py + m[5] * pz + m[10],
+        wz = m[6] * px + m[7] * py + m[8] * pz,
+        D = 1 / (wz + m[11]);
+  *x = v->cx + v->sx * D * wx;
+  *y = v->cy + v->sy * D * wy;
+  return D;
+}
+
+// Rotates, projects and z-tests the samples [begin, end) one at a time
+static inline void rasterRange(const TorusGeometry *g, const float *m, const Lighting *light, const Viewport *v,
+                               uint32_t *depth, int begin, int end)
+{
+  Lighting lights = *light; // A copy the depth stores cannot alias, so it stays in registers
+  for (int k = begin; k < end; k++)
+  {
+    // Projection to 2D (x, y) and depth calculation (o)
+    int x, y;
+    float D = projectSample(g, m, v, k, &x, &y);
+    int o = x + v->width * y;
+    // Brightness (N) from the normal and the lights, both in object space
+    int N = shade(&lights, g->nx[k], g->ny[k], g->nz[k]);
+
+    // Z-buffer test and drawing: depth and brightness in one word, the
+    // encoder picks the character
+    uint32_t w = depthWord(D, N);
+    if (v->height > y && y > 0 && x > 0 && v->width > x && w > depth[o])
     {
-      // Error reading (except "no data available")
-      perror("read stdin failed"); // English error
-      quit = 1;                    // Exit on read error
-      continue;
+      depth[o] = w;
+      rasterPasses++;
     }
+  }
+}
+
+// Reference rasterizer: rotates every sample, projects it to 2D and keeps the
+// nearest one per point in the packed depth buffer
+void rasterScalar(const TorusGeometry *g, const float *m, const Lighting *light, const Viewport *v, uint32_t *depth)
+{
+  rasterRange(g, m, light, v, depth, 0, g->count);
+}
 
-    memset(b, 32, 1760);     // Clear framebuffer (characters) (fill with spaces)
-    memset(z, 0, sizeof(z)); // Clear depth buffer (fill with 0)
+// The vector kernels compute projection, depth words and bounds for a
+// whole vector of samples, then resolve the depth test lane by lane. Lanes
+// that land on the same point keep the larger word, as in the scalar loop.
+static inline void resolveLanes(unsigned mask, const int *o, const uint32_t *W, uint32_t *depth)
+{
+  while (mask)
+  {
+    int lane = __builtin_ctz(mask);
+    mask &= mask - 1;
+    if (W[lane] > depth[o[lane]])
+    {
+      depth[o[lane]] = W[lane];
+      rasterPasses++;
+    }
+  }
+}
 
-    // Donut calculation (rotation and projection)
-    for (j = 0; 6.28 > j; j += 0.07)
-    { // Outer ring (torus rotation j)
-      for (i = 0; 6.28 > i; i += 0.02)
-      { // Inner ring (circle rotation i)
-        float c = sin(i), d = cos(j), e = sin(A), f = sin(j), g = cos(A),
-              h = d + 2, D = 1 / (c * h * e + f * g + 5), l = cos(i),
-              m = cos(B), n = sin(B),
-              t = c * h * g - f * e;
-        // Projection to 2D (x, y) and depth calculation (o)
-        int x = 40 + 30 * D * (l * h * m - t * n),
-            y = 12 + 15 * D * (l * h * n + t * m), o = x + 80 * y;
-        // Calculation of surface normal and brightness (N)
-        int N = 8 * ((f * e - c * d * g) * m - c * d * e - f * g - l * d * n);
+#ifdef HAVE_X86_KERNELS
+// The x86 kernels are compiled for their instruction set regardless of the
+// build flags and only called after the CPU has been checked at startup.
 
-        // Z-buffer test and drawing
-        if (22 > y && y > 0 && x > 0 && 80 > x && D > z[o])
-        {
-          z[o] = D; // Store depth
-          // Select character based on brightness
-          b[o] = ".,-~:;=!*#$@"[N > 0 ? N : 0];
-        }
-      }
+// 4 samples per iteration with SSE4.1
+__attribute__((target("sse4.1"))) void rasterSSE41(const TorusGeometry *g, const float *m, const Lighting *light, const Viewport *v, uint32_t *depth)
+{
+  __m128 m0 = _mm_set1_ps(m[0]), m1 = _mm_set1_ps(m[1]), m2 = _mm_set1_ps(m[2]),
+         m3 = _mm_set1_ps(m[3]), m4 = _mm_set1_ps(m[4]), m5 = _mm_set1_ps(m[5]),
+         m6 = _mm_set1_ps(m[6]), m7 = _mm_set1_ps(m[7]), m8 = _mm_set1_ps(m[8]);
+  __m128 one = _mm_set1_ps(1), tx = _mm_set1_ps(m[9]), ty = _mm_set1_ps(m[10]), tz = _mm_set1_ps(m[11]),
+         scale = _mm_set1_ps(DEPTH_SCALE), dmax = _mm_set1_ps(DEPTH_MAX),
+         cx = _mm_set1_ps(v->cx), sx = _mm_set1_ps(v->sx), cy = _mm_set1_ps(v->cy), sy = _mm_set1_ps(v->sy);
+  __m128i zero = _mm_setzero_si128(), w = _mm_set1_epi32(v->width), h = _mm_set1_epi32(v->height),
+          top = _mm_set1_epi32(LUMINANCE_LEVELS - 1), tag = _mm_set1_epi32((int)light->tag);
+  __m128 lx[MAX_LIGHTS], ly[MAX_LIGHTS], lz[MAX_LIGHTS];
+  for (int l = 0; l < light->count; l++)
+  {
+    lx[l] = _mm_set1_ps(light->dir[l][0]), ly[l] = _mm_set1_ps(light->dir[l][1]), lz[l] = _mm_set1_ps(light->dir[l][2]);
+  }
+  int o[4];
+  uint32_t W[4];
+  int k = 0;
+  for (; k + 4 <= g->count; k += 4)
+  {
+    __m128 px = _mm_loadu_ps(g->px + k), py = _mm_loadu_ps(g->py + k), pz = _mm_loadu_ps(g->pz + k);
+    __m128 nx = _mm_loadu_ps(g->nx + k), ny = _mm_loadu_ps(g->ny + k), nz = _mm_loadu_ps(g->nz + k);
+    __m128 wx = _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(m0, px), _mm_mul_ps(m1, py)), _mm_mul_ps(m2, pz)), tx);
+    __m128 wy = _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(m3, px), _mm_mul_ps(m4, py)), _mm_mul_ps(m5, pz)), ty);
+    __m128 wz = _mm_add_ps(_mm_add_ps(_mm_mul_ps(m6, px), _mm_mul_ps(m7, py)), _mm_mul_ps(m8, pz));
+    __m128 d = _mm_div_ps(one, _mm_add_ps(wz, tz));
+    __m128i x = _mm_cvttps_epi32(_mm_add_ps(cx, _mm_mul_ps(_mm_mul_ps(sx, d), wx)));
+    __m128i y = _mm_cvttps_epi32(_mm_add_ps(cy, _mm_mul_ps(_mm_mul_ps(sy, d), wy)));
+    __m128 sum = _mm_setzero_ps();
+    for (int l = 0; l < light->count; l++)
+    {
+      __m128 dot = _mm_add_ps(_mm_add_ps(_mm_mul_ps(lx[l], nx), _mm_mul_ps(ly[l], ny)), _mm_mul_ps(lz[l], nz));
+      sum = _mm_add_ps(sum, _mm_max_ps(dot, _mm_setzero_ps()));
     }
+    __m128i n = _mm_cvttps_epi32(sum);
+    __m128i valid = _mm_and_si128(_mm_and_si128(_mm_cmpgt_epi32(h, y), _mm_cmpgt_epi32(y, zero)),
+                                  _mm_and_si128(_mm_cmpgt_epi32(x, zero), _mm_cmpgt_epi32(w, x)));
+    unsigned mask = (unsigned)_mm_movemask_ps(_mm_castsi128_ps(valid));
+    if (mask)
+    {
+      _mm_storeu_si128((__m128i *)o, _mm_add_epi32(x, _mm_mullo_epi32(w, y)));
+      __m128i q = _mm_cvttps_epi32(_mm_min_ps(_mm_mul_ps(d, scale), dmax));
+      _mm_storeu_si128((__m128i *)W, _mm_or_si128(_mm_slli_epi32(q, DEPTH_SHIFT), _mm_or_si128(_mm_min_epi32(n, top), tag)));
+      resolveLanes(mask, o, W, depth);
+    }
+  }
+  rasterRange(g, m, light, v, depth, k, g->count);
+}
 
-    printf("\x1b[H"); // Cursor to home position
-    // Output framebuffer with colors
-    for (int k = 0; 1761 > k; k++)
-    { // Go through all characters of the framebuffer + 1
-      if (k % 80 == 0)
-      {
-        putchar('\n'); // New line after 80 characters (or at k=0)
-      }
-      else
-      {
-        char ch = (k < 1760) ? b[k] : ' '; // Ensure we don't read out-of-bounds
-        const char *color_code = "";       // Default: no color (for spaces)
+// 8 samples per iteration with AVX2
+__attribute__((target("avx2"))) void rasterAVX2(const TorusGeometry *g, const float *m, const Lighting *light, const Viewport *v, uint32_t *depth)
+{
+  __m256 m0 = _mm256_set1_ps(m[0]), m1 = _mm256_set1_ps(m[1]), m2 = _mm256_set1_ps(m[2]),
+         m3 = _mm256_set1_ps(m[3]), m4 = _mm256_set1_ps(m[4]), m5 = _mm256_set1_ps(m[5]),
+         m6 = _mm256_set1_ps(m[6]), m7 = _mm256_set1_ps(m[7]), m8 = _mm256_set1_ps(m[8]);
+  __m256 one = _mm256_set1_ps(1), tx = _mm256_set1_ps(m[9]), ty = _mm256_set1_ps(m[10]), tz = _mm256_set1_ps(m[11]),
+         scale = _mm256_set1_ps(DEPTH_SCALE),
+         dmax = _mm256_set1_ps(DEPTH_MAX),
+         cx = _mm256_set1_ps(v->cx), sx = _mm256_set1_ps(v->sx), cy = _mm256_set1_ps(v->cy), sy = _mm256_set1_ps(v->sy);
+  __m256i zero = _mm256_setzero_si256(), w = _mm256_set1_epi32(v->width), h = _mm256_set1_epi32(v->height),
+          top = _mm256_set1_epi32(LUMINANCE_LEVELS - 1), tag = _mm256_set1_epi32((int)light->tag);
+  __m256 lx[MAX_LIGHTS], ly[MAX_LIGHTS], lz[MAX_LIGHTS];
+  for (int l = 0; l < light->count; l++)
+  {
+    lx[l] = _mm256_set1_ps(light->dir[l][0]), ly[l] = _mm256_set1_ps(light->dir[l][1]),
+    lz[l] = _mm256_set1_ps(light->dir[l][2]);
+  }
+  int o[8];
+  uint32_t W[8];
+  int k = 0;
+  for (; k + 8 <= g->count; k += 8)
+  {
+    __m256 px = _mm256_loadu_ps(g->px + k), py = _mm256_loadu_ps(g->py + k), pz = _mm256_loadu_ps(g->pz + k);
+    __m256 nx = _mm256_loadu_ps(g->nx + k), ny = _mm256_loadu_ps(g->ny + k), nz = _mm256_loadu_ps(g->nz + k);
+    __m256 wx = _mm256_add_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(m0, px), _mm256_mul_ps(m1, py)), _mm256_mul_ps(m2, pz)), tx);
+    __m256 wy = _mm256_add_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(m3, px), _mm256_mul_ps(m4, py)), _mm256_mul_ps(m5, pz)), ty);
+    __m256 wz = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(m6, px), _mm256_mul_ps(m7, py)), _mm256_mul_ps(m8, pz));
+    __m256 d = _mm256_div_ps(one, _mm256_add_ps(wz, tz));
+    __m256i x = _mm256_cvttps_epi32(_mm256_add_ps(cx, _mm256_mul_ps(_mm256_mul_ps(sx, d), wx)));
+    __m256i y = _mm256_cvttps_epi32(_mm256_add_ps(cy, _mm256_mul_ps(_mm256_mul_ps(sy, d), wy)));
+    __m256 sum = _mm256_setzero_ps();
+    for (int l = 0; l < light->count; l++)
+    {
+      __m256 dot = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(lx[l], nx), _mm256_mul_ps(ly[l], ny)),
+                                 _mm256_mul_ps(lz[l], nz));
+      sum = _mm256_add_ps(sum, _mm256_max_ps(dot, _mm256_setzero_ps()));
+    }
+    __m256i n = _mm256_cvttps_epi32(sum);
+    __m256i valid = _mm256_and_si256(_mm256_and_si256(_mm256_cmpgt_epi32(h, y), _mm256_cmpgt_epi32(y, zero)),
+                                     _mm256_and_si256(_mm256_cmpgt_epi32(x, zero), _mm256_cmpgt_epi32(w, x)));
+    unsigned mask = (unsigned)_mm256_movemask_ps(_mm256_castsi256_ps(valid));
+    if (mask)
+    {
+      _mm256_storeu_si256((__m256i *)o, _mm256_add_epi32(x, _mm256_mullo_epi32(w, y)));
+      __m256i q = _mm256_cvttps_epi32(_mm256_min_ps(_mm256_mul_ps(d, scale), dmax));
+      _mm256_storeu_si256((__m256i *)W, _mm256_or_si256(_mm256_slli_epi32(q, DEPTH_SHIFT), _mm256_or_si256(_mm256_min_epi32(n, top), tag)));
+      resolveLanes(mask, o, W, depth);
+    }
+  }
+  rasterRange(g, m, light, v, depth, k, g->count);
+}
 
-        // Color based on character intensity and selected palette
-        if (strchr(".,-", ch))
-        {
-          color_code = colorPalette[0]; // Low intensity
-        }
-        else if (strchr("~:;=", ch))
-        {
-          color_code = colorPalette[1]; // Medium intensity
-        }
-        else if (strchr("!*#$@", ch))
-        {
-          color_code = colorPalette[2]; // High intensity (Highlight)
-        }
+// 16 samples per iteration with AVX-512
+__attribute__((target("avx512f"))) void rasterAVX512(const TorusGeometry *g, const float *m, const Lighting *light, const Viewport *v, uint32_t *depth)
+{
+  __m512 m0 = _mm512_set1_ps(m[0]), m1 = _mm512_set1_ps(m[1]), m2 = _mm512_set1_ps(m[2]),
+         m3 = _mm512_set1_ps(m[3]), m4 = _mm512_set1_ps(m[4]), m5 = _mm512_set1_ps(m[5]),
+         m6 = _mm512_set1_ps(m[6]), m7 = _mm512_set1_ps(m[7]), m8 = _mm512_set1_ps(m[8]);
+  __m512 one = _mm512_set1_ps(1), tx = _mm512_set1_ps(m[9]), ty = _mm512_set1_ps(m[10]), tz = _mm512_set1_ps(m[11]),
+         scale = _mm512_set1_ps(DEPTH_SCALE),
+         dmax = _mm512_set1_ps(DEPTH_MAX),
+         cx = _mm512_set1_ps(v->cx), sx = _mm512_set1_ps(v->sx), cy = _mm512_set1_ps(v->cy), sy = _mm512_set1_ps(v->sy);
+  __m512i zero = _mm512_setzero_si512(), w = _mm512_set1_epi32(v->width), h = _mm512_set1_epi32(v->height),
+          top = _mm512_set1_epi32(LUMINANCE_LEVELS - 1), tag = _mm512_set1_epi32((int)light->tag);
+  __m512 lx[MAX_LIGHTS], ly[MAX_LIGHTS], lz[MAX_LIGHTS];
+  for (int l = 0; l < light->count; l++)
+  {
+    lx[l] = _mm512_set1_ps(light->dir[l][0]), ly[l] = _mm512_set1_ps(light->dir[l][1]),
+    lz[l] = _mm512_set1_ps(light->dir[l][2]);
+  }
+  int o[16];
+  uint32_t W[16];
+  int k = 0;
+  for (; k + 16 <= g->count; k += 16)
+  {
+    __m512 px = _mm512_loadu_ps(g->px + k), py = _mm512_loadu_ps(g->py + k), pz = _mm512_loadu_ps(g->pz + k);
+    __m512 nx = _mm512_loadu_ps(g->nx + k), ny = _mm512_loadu_ps(g->ny + k), nz = _mm512_loadu_ps(g->nz + k);
+    __m512 wx = _mm512_add_ps(_mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(m0, px), _mm512_mul_ps(m1, py)), _mm512_mul_ps(m2, pz)), tx);
+    __m512 wy = _mm512_add_ps(_mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(m3, px), _mm512_mul_ps(m4, py)), _mm512_mul_ps(m5, pz)), ty);
+    __m512 wz = _mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(m6, px), _mm512_mul_ps(m7, py)), _mm512_mul_ps(m8, pz));
+    __m512 d = _mm512_div_ps(one, _mm512_add_ps(wz, tz));
+    __m512i x = _mm512_cvttps_epi32(_mm512_add_ps(cx, _mm512_mul_ps(_mm512_mul_ps(sx, d), wx)));
+    __m512i y = _mm512_cvttps_epi32(_mm512_add_ps(cy, _mm512_mul_ps(_mm512_mul_ps(sy, d), wy)));
+    __m512 sum = _mm512_setzero_ps();
+    for (int l = 0; l < light->count; l++)
+    {
+      __m512 dot = _mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(lx[l], nx), _mm512_mul_ps(ly[l], ny)),
+                                 _mm512_mul_ps(lz[l], nz));
+      sum = _mm512_add_ps(sum, _mm512_max_ps(dot, _mm512_setzero_ps()));
+    }
+    __m512i n = _mm512_cvttps_epi32(sum);
+    unsigned mask = _mm512_cmpgt_epi32_mask(h, y) & _mm512_cmpgt_epi32_mask(y, zero) &
+                    _mm512_cmpgt_epi32_mask(x, zero) & _mm512_cmpgt_epi32_mask(w, x);
+    if (mask)
+    {
+      _mm512_storeu_si512(o, _mm512_add_epi32(x, _mm512_mullo_epi32(w, y)));
+      __m512i q = _mm512_cvttps_epi32(_mm512_min_ps(_mm512_mul_ps(d, scale), dmax));
+      _mm512_storeu_si512(W, _mm512_or_si512(_mm512_slli_epi32(q, DEPTH_SHIFT), _mm512_or_si512(_mm512_min_epi32(n, top), tag)));
+      resolveLanes(mask, o, W, depth);
+    }
+  }
+  rasterRange(g, m, light, v, depth, k, g->count);
+}
+#endif
 
-        // Print color code, character, and reset code
-        // Important: Use color codes directly here
-        printf("%s%c\x1b[0m", color_code, ch);
-      }
+#ifdef HAVE_NEON_KERNEL
+// 4 samples per iteration with NEON
+void rasterNEON(const TorusGeometry *g, const float *m, const Lighting *light, const Viewport *v, uint32_t *depth)
+{
+  float32x4_t m0 = vdupq_n_f32(m[0]), m1 = vdupq_n_f32(m[1]), m2 = vdupq_n_f32(m[2]),
+              m3 = vdupq_n_f32(m[3]), m4 = vdupq_n_f32(m[4]), m5 = vdupq_n_f32(m[5]),
+              m6 = vdupq_n_f32(m[6]), m7 = vdupq_n_f32(m[7]), m8 = vdupq_n_f32(m[8]);
+  float32x4_t one = vdupq_n_f32(1), tx = vdupq_n_f32(m[9]), ty = vdupq_n_f32(m[10]), tz = vdupq_n_f32(m[11]),
+              scale = vdupq_n_f32(DEPTH_SCALE),
+              dmax = vdupq_n_f32(DEPTH_MAX),
+              cx = vdupq_n_f32(v->cx), sx = vdupq_n_f32(v->sx), cy = vdupq_n_f32(v->cy), sy = vdupq_n_f32(v->sy);
+  int32x4_t zero = vdupq_n_s32(0), w = vdupq_n_s32(v->width), h = vdupq_n_s32(v->height),
+            top = vdupq_n_s32(LUMINANCE_LEVELS - 1), tag = vdupq_n_s32((int)light->tag);
+  float32x4_t lx[MAX_LIGHTS], ly[MAX_LIGHTS], lz[MAX_LIGHTS];
+  for (int l = 0; l < light->count; l++)
+  {
+    lx[l] = vdupq_n_f32(light->dir[l][0]), ly[l] = vdupq_n_f32(light->dir[l][1]), lz[l] = vdupq_n_f32(light->dir[l][2]);
+  }
+  uint32x4_t bits = {1, 2, 4, 8};
+  int o[4];
+  uint32_t W[4];
+  int k = 0;
+  for (; k + 4 <= g->count; k += 4)
+  {
+    float32x4_t px = vld1q_f32(g->px + k), py = vld1q_f32(g->py + k), pz = vld1q_f32(g->pz + k);
+    float32x4_t nx = vld1q_f32(g->nx + k), ny = vld1q_f32(g->ny + k), nz = vld1q_f32(g->nz + k);
+    float32x4_t wx = vaddq_f32(vaddq_f32(vaddq_f32(vmulq_f32(m0, px), vmulq_f32(m1, py)), vmulq_f32(m2, pz)), tx);
+    float32x4_t wy = vaddq_f32(vaddq_f32(vaddq_f32(vmulq_f32(m3, px), vmulq_f32(m4, py)), vmulq_f32(m5, pz)), ty);
+    float32x4_t wz = vaddq_f32(vaddq_f32(vmulq_f32(m6, px), vmulq_f32(m7, py)), vmulq_f32(m8, pz));
+    float32x4_t d = vdivq_f32(one, vaddq_f32(wz, tz));
+    int32x4_t x = vcvtq_s32_f32(vaddq_f32(cx, vmulq_f32(vmulq_f32(sx, d), wx)));
+    int32x4_t y = vcvtq_s32_f32(vaddq_f32(cy, vmulq_f32(vmulq_f32(sy, d), wy)));
+    float32x4_t sum = vdupq_n_f32(0);
+    for (int l = 0; l < light->count; l++)
+    {
+      float32x4_t dot = vaddq_f32(vaddq_f32(vmulq_f32(lx[l], nx), vmulq_f32(ly[l], ny)), vmulq_f32(lz[l], nz));
+      sum = vaddq_f32(sum, vmaxq_f32(dot, vdupq_n_f32(0)));
     }
-    fflush(stdout); // Ensure frame is displayed immediately
+    int32x4_t n = vcvtq_s32_f32(sum);
+    uint32x4_t valid = vandq_u32(vandq_u32(vcltq_s32(y, h), vcgtq_s32(y, zero)),
+                                 vandq_u32(vcgtq_s32(x, zero), vcltq_s32(x, w)));
+    unsigned mask = vaddvq_u32(vandq_u32(valid, bits));
+    if (mask)
+    {
+      vst1q_s32(o, vmlaq_s32(x, w, y));
+      int32x4_t q = vcvtq_s32_f32(vminq_f32(vmulq_f32(d, scale), dmax));
+      vst1q_u32(W, vreinterpretq_u32_s32(vorrq_s32(vshlq_n_s32(q, DEPTH_SHIFT), vorrq_s32(vminq_s32(n, top), tag))));
+      resolveLanes(mask, o, W, depth);
+    }
+  }
+  rasterRange(g, m, light, v, depth, k, g->count);
+}
+#endif
 
-    // Update rotation angles
-    A += 0.04;
-    B += 0.02;
+// (a * D) >> FIXED_D_BITS for a below 2^47 and D below 2^30 in magnitude,
+// from two products that fit 64 bits
+static inline long long fixedMulD(long long a, long long D)
+{
+  return ((a >> 16) * D >> (FIXED_D_BITS - 16)) + ((a & 0xFFFF) * D >> FIXED_D_BITS);
+}
 
-    // Wait time based on speed factor
-    usleep((useconds_t)(baseSleep / speedFactor));
+// Fixed-point rasterizer for CPUs with slow float conversion and division.
+// Positions and normals are Q28 (FIXED_POS_BITS), which holds the float
+// samples all but exactly, and products are 64-bit. The x and y rows of
+// the rotation are scaled to raster points (sx and sy stay below 2^11 up to
+// MAX_COLS x MAX_ROWS), so a row times a position stays below 2^61. The
+// perspective divide is a lookup with linear interpolation in
+// geometry.recip, refined by one Newton step to the precision of Q30; the
+// table covers the depths of a torus 5 units away. The dot products of the
+// lights (Q26, at most 8 sqrt(2) long) with a normal are summed unrounded,
+// so a luminance level differs from the float one only where the sum lies
+// within its rounding error of a level boundary. Projections are as exact,
+// but at the edge of the torus the point a sample falls into decides which
+// surface the point shows, so a sample within the float rounding error of
+// a point boundary is projected with floats instead, as in rasterScalar().
+// That is rare enough to cost nothing, and the luminance matches within
+// one level.
+void rasterFixed(const TorusGeometry *g, const float *m, const Lighting *light, const Viewport *v, uint32_t *depth)
+{
+  long long qx[3], qy[3], qz[3];
+  for (int i = 0; i < 3; i++)
+  {
+    qx[i] = llrint((double)m[i] * v->sx * (1 << FIXED_PROJ_BITS));
+    qy[i] = llrint((double)m[3 + i] * v->sy * (1 << FIXED_PROJ_BITS));
+    qz[i] = llrint((double)m[6 + i] * (1 << FIXED_MAT_BITS));
+  }
+  // Position of the torus (x and y in raster points) and projection center
+  // in Q28
+  long long tx = llrint((double)m[9] * v->sx * (1 << FIXED_POS_BITS)),
+            ty = llrint((double)m[10] * v->sy * (1 << FIXED_POS_BITS)),
+            tz = llrint((double)m[11] * (1 << FIXED_POS_BITS));
+  long long cx = llrint((double)v->cx * (1 << FIXED_POS_BITS)), cy = llrint((double)v->cy * (1 << FIXED_POS_BITS));
+  // Distance from a point boundary within which floats may round either
+  // way: a few units in the last place of the largest coordinates
+  const long long mask = (1LL << FIXED_POS_BITS) - 1;
+  long long slackX = llrint((v->cx + v->sx) * (1 << (FIXED_POS_BITS - 18))),
+            slackY = llrint((v->cy + v->sy) * (1 << (FIXED_POS_BITS - 18)));
+  int ql[MAX_LIGHTS][3];
+  for (int l = 0; l < light->count; l++)
+  {
+    for (int i = 0; i < 3; i++)
+    {
+      ql[l][i] = (int)lrintf(light->dir[l][i] * (1 << FIXED_LIGHT_BITS));
+    }
+  }
+  const int *recip = g->recip;
+  for (int k = 0; k < g->count; k++)
+  {
+    long long px = g->ipx[k], py = g->ipy[k], pz = g->ipz[k];
+    long long nx = g->inx[k], ny = g->iny[k], nz = g->inz[k];
+    // x and y times z + 5 in raster points, z + 5 in units, all Q28
+    long long wx = ((qx[0] * px + qx[1] * py + qx[2] * pz) >> FIXED_PROJ_BITS) + tx,
+              wy = ((qy[0] * px + qy[1] * py + qy[2] * pz) >> FIXED_PROJ_BITS) + ty,
+              wz = ((qz[0] * px + qz[1] * py + qz[2] * pz) >> FIXED_MAT_BITS) + tz;
+    long long u = wz - RECIP_BASE;
+    const int *r = recip + (u >> RECIP_STEP_BITS);
+    long long D = r[0] + (((long long)(r[1] - r[0]) * (u & ((1 << RECIP_STEP_BITS) - 1))) >> RECIP_STEP_BITS);
+    D = D * ((2LL << FIXED_D_BITS) - (wz * D >> FIXED_POS_BITS)) >> FIXED_D_BITS;
+    // Arithmetic shifts round down where the float path truncates; both
+    // only differ for negative coordinates, which are off screen either way
+    long long rx = cx + fixedMulD(wx, D), ry = cy + fixedMulD(wy, D);
+    int x = (int)(rx >> FIXED_POS_BITS), y = (int)(ry >> FIXED_POS_BITS);
+    if (((rx + slackX) & mask) < 2 * slackX || ((ry + slackY) & mask) < 2 * slackY)
+    {
+      projectSample(g, m, v, k, &x, &y);
+    }
+    int o = x + v->width * y;
+    long long sum = 0;
+    for (int l = 0; l < light->count; l++)
+    {
+      long long dot = ql[l][0] * nx + ql[l][1] * ny + ql[l][2] * nz;
+      sum += dot > 0 ? dot : 0;
+    }
+    int N = (int)(sum >> (FIXED_LIGHT_BITS + FIXED_POS_BITS));
+    N = (N < LUMINANCE_LEVELS - 1 ? N : LUMINANCE_LEVELS - 1) | (int)light->tag;
+    long long dq = D >> (FIXED_D_BITS - DEPTH_BITS);
+    uint32_t w = (uint32_t)(dq < DEPTH_MAX ? dq : DEPTH_MAX) << DEPTH_SHIFT | (uint32_t)N;
+    if (v->height > y && y > 0 && x > 0 && v->width > x && w > depth[o])
+    {
+      depth[o] = w;
+      rasterPasses++;
+    }
+  }
+}
+
+// Rasterizer kernels in order of preference, best last. The fixed-point
+// kernel is approximate and never chosen automatically.
+typedef struct
+{
+  const char *name;
+  RasterKernel fn;
+  int supported; // Usable on this CPU, set by detectRasterKernels()
+} KernelInfo;
+
+KernelInfo rasterKernels[] = {
+    {"fixed", rasterFixed, 1},
+    {"scalar", rasterScalar, 1},
+#ifdef HAVE_X86_KERNELS
+    {"sse4.1", rasterSSE41, 0},
+    {"avx2", rasterAVX2, 0},
+    {"avx512", rasterAVX512, 0},
+#endif
+#ifdef HAVE_NEON_KERNEL
+    {"neon", rasterNEON, 1}, // NEON is mandatory on AArch64
+#endif
+};
+#define RASTER_KERNEL_COUNT (int)(sizeof(rasterKernels) / sizeof(rasterKernels[0]))
+
+// Checks which kernels the running CPU (and OS) can execute
+void detectRasterKernels()
+{
+#ifdef HAVE_X86_KERNELS
+  __builtin_cpu_init();
+  for (int k = 0; k < RASTER_KERNEL_COUNT; k++)
+  {
+    if (strcmp(rasterKernels[k].name, "sse4.1") == 0)
+    {
+      rasterKernels[k].supported = __builtin_cpu_supports("sse4.1");
+    }
+    else if (strcmp(rasterKernels[k].name, "avx2") == 0)
+    {
+      rasterKernels[k].supported = __builtin_cpu_supports("avx2");
+    }
+    else if (strcmp(rasterKernels[k].name, "avx512") == 0)
+    {
+      rasterKernels[k].supported = __builtin_cpu_supports("avx512f");
+    }
+  }
+#endif
+}
+
+// Looks up a kernel by name; "auto" picks the best one the CPU supports.
+// Returns NULL for unknown names.
+KernelInfo *findRasterKernel(const char *name)
+{
+  KernelInfo *best = NULL;
+  for (int k = 0; k < RASTER_KERNEL_COUNT; k++)
+  {
+    if (strcmp(name, "auto") == 0 ? rasterKernels[k].supported : strcmp(name, rasterKernels[k].name) == 0)
+    {
+      best = &rasterKernels[k];
+    }
+  }
+  return best;
+}
+
+// Prints the kernel names of this build, e.g. "scalar, sse4.1, avx2"
+void printRasterKernels(FILE *out)
+{
+  for (int k = 0; k < RASTER_KERNEL_COUNT; k++)
+  {
+    fprintf(out, "%s%s%s", k ? ", " : "", rasterKernels[k].name, rasterKernels[k].supported ? "" : " (unsupported)");
+  }
+}
+
+// Image-order engine: instead of projecting samples, one ray per cell is
+// intersected with the torus, so every covered cell is hit exactly once at
+// any size. The ray leaves the eye through the cell center; in object
+// space (rotated back by the transposed matrix) it starts at -5 times the
+// last matrix row and has the direction u * row0 + v * row1 + row2, where
+// (u, v) is the cell center before the projection. Parameterized like
+// that, the ray reaches the world depth wz at t = wz + 5, so D = 1 / t.
+// A ray hits once it is closer to the surface than RAY_CONE cell widths at
+// its depth: the cell then holds part of the torus, as with the points
+// engine, and rays grazing the rim finish in a few steps. 0.85 (between
+// half the width and half the height of a cell) covers the cells closest
+// to what the points engine covers.
+#define RAY_STEPS 48    // Sphere-tracing steps before giving up on a ray
+#define RAY_CONE 0.85f
+
+// Signature shared by the ray kernels: traces the rows first, first + step,
+// ... of the framebuffer up to area->y1, in the columns of area, for the
+// torus placed by transform m
+typedef void (*RayKernel)(const float *m, const Lighting *light, const Viewport *v, const Rect *area, uint32_t *depth,
+                          int first, int step);
+
+// Signed distance from p to the torus surface (ring radius 2, tube radius
+// 1, around the z axis)
+static inline float torusDistance(float px, float py, float pz, float *ring)
+{
+  *ring = sqrtf(px * px + py * py);
+  float r = *ring - 2;
+  return sqrtf(r * r + pz * pz) - 1;
+}
+
+// Traces the ray through cell center (u, v); cone is the hit distance per
+// unit of t in object space. Returns the luminance index and sets *D, or
+// returns -1 if the ray misses.
+static inline int rayCell(const float *m, const Lighting *light, float u, float v, float cone, float *D)
+{
+  // The ray t (u, v, 1) meets the bounding sphere of radius 3s around the
+  // center c where a t^2 - 2 b t + c.c - 9 s^2 = 0, b = (u, v, 1) . c. For
+  // the classic torus that leaves the rays with u^2 + v^2 < 9 / 16.
+  float s = m[12], c = m[9] * m[9] + m[10] * m[10] + m[11] * m[11] - 9 * s * s;
+  float b = u * m[9] + v * m[10] + m[11], uv = u * u + v * v;
+  float a = uv + 1, disc = b * b - c - c * uv;
+  if (disc <= 0)
+  {
+    return -1;
+  }
+  // Object space is view space moved by -c, rotated back and divided by s,
+  // so d and o take M^T / s^2 and distances there count s times along t
+  float root = sqrtf(disc), t = (b - root) / a, end = (b + root) / a, stride = s / sqrtf(a), is = 1 / (s * s);
+  float dx = (u * m[0] + v * m[3] + m[6]) * is, dy = (u * m[1] + v * m[4] + m[7]) * is,
+        dz = (u * m[2] + v * m[5] + m[8]) * is;
+  float ox = -(m[0] * m[9] + m[3] * m[10] + m[6] * m[11]) * is, oy = -(m[1] * m[9] + m[4] * m[10] + m[7] * m[11]) * is,
+        oz = -(m[2] * m[9] + m[5] * m[10] + m[8] * m[11]) * is;
+  float px, py, pz, ring, dist = 1;
+  for (int step = 0; step < RAY_STEPS; step++)
+  {
+    px = ox + t * dx, py = oy + t * dy, pz = oz + t * dz;
+    dist = torusDistance(px, py, pz, &ring);
+    if (dist < cone * t || t > end || step + 1 == RAY_STEPS)
+    {
+      break;
+    }
+    t += dist * stride;
+  }
+  if (t > end || dist >= cone * t)
+  {
+    return -1;
+  }
+  // Surface normal: away from the nearest point on the center ring
+  float k = 1 - 2 / ring, scale = 1 / (dist + 1);
+  float nx = px * k * scale, ny = py * k * scale, nz = pz * scale;
+  *D = 1 / t;
+  return shade(light, nx, ny, nz);
+}
+
+// Reference ray kernel, one cell at a time
+void rayScalar(const float *m, const Lighting *light, const Viewport *v, const Rect *area, uint32_t *depth, int first, int step)
+{
+  float cone = RAY_CONE / (v->sx * m[12]);
+  Lighting lights = *light; // Not aliased by the depth stores
+  for (int y = first; y < area->y1; y += step)
+  {
+    float rv = (y + 0.5f - v->cy) / v->sy;
+    for (int x = area->x0; x < area->x1; x++)
+    {
+      float D;
+      int N = rayCell(m, &lights, (x + 0.5f - v->cx) / v->sx, rv, cone, &D);
+      int o = x + v->width * y;
+      if (N >= 0 && depthWord(D, N) > depth[o])
+      {
+        depth[o] = depthWord(D, N);
+        rasterPasses++;
+      }
+    }
+  }
+}
+
+#ifdef HAVE_X86_KERNELS
+// 8 adjacent cells per iteration with AVX2. Lanes that hit or leave the
+// bounding sphere stop stepping; the batch ends when all lanes are done.
+__attribute__((target("avx2,fma"))) void rayAVX2(const float *m, const Lighting *light, const Viewport *v, const Rect *area, uint32_t *depth, int first, int step)
+{
+  __m256 m0 = _mm256_set1_ps(m[0]), m1 = _mm256_set1_ps(m[1]), m2 = _mm256_set1_ps(m[2]),
+         m3 = _mm256_set1_ps(m[3]), m4 = _mm256_set1_ps(m[4]), m5 = _mm256_set1_ps(m[5]),
+         m6 = _mm256_set1_ps(m[6]), m7 = _mm256_set1_ps(m[7]), m8 = _mm256_set1_ps(m[8]);
+  // Origin, direction scale and sphere terms as in rayCell()
+  float is = 1 / (m[12] * m[12]), c = m[9] * m[9] + m[10] * m[10] + m[11] * m[11] - 9 * m[12] * m[12];
+  __m256 ox = _mm256_set1_ps(-(m[0] * m[9] + m[3] * m[10] + m[6] * m[11]) * is),
+         oy = _mm256_set1_ps(-(m[1] * m[9] + m[4] * m[10] + m[7] * m[11]) * is),
+         oz = _mm256_set1_ps(-(m[2] * m[9] + m[5] * m[10] + m[8] * m[11]) * is);
+  __m256 one = _mm256_set1_ps(1), two = _mm256_set1_ps(2), tx = _mm256_set1_ps(m[9]), cc = _mm256_set1_ps(c),
+         inv = _mm256_set1_ps(is), size = _mm256_set1_ps(m[12]), zero = _mm256_setzero_ps(),
+         cone = _mm256_set1_ps(RAY_CONE / (v->sx * m[12])), depthScale = _mm256_set1_ps(DEPTH_SCALE),
+         dmax = _mm256_set1_ps(DEPTH_MAX);
+  __m256 lanes = _mm256_setr_ps(0, 1, 2, 3, 4, 5, 6, 7);
+  __m256i top = _mm256_set1_epi32(LUMINANCE_LEVELS - 1), tag = _mm256_set1_epi32((int)light->tag);
+  __m256 lx[MAX_LIGHTS], ly[MAX_LIGHTS], lz[MAX_LIGHTS];
+  for (int l = 0; l < light->count; l++)
+  {
+    lx[l] = _mm256_set1_ps(light->dir[l][0]), ly[l] = _mm256_set1_ps(light->dir[l][1]),
+    lz[l] = _mm256_set1_ps(light->dir[l][2]);
+  }
+  uint32_t W[8];
+  for (int y = first; y < area->y1; y += step)
+  {
+    float fv = (y + 0.5f - v->cy) / v->sy;
+    __m256 rv = _mm256_set1_ps(fv), bv = _mm256_set1_ps(fv * m[10] + m[11]);
+    __m256 vv = _mm256_mul_ps(rv, rv);
+    for (int x = area->x0; x < area->x1; x += 8)
+    {
+      __m256 u = _mm256_div_ps(_mm256_add_ps(_mm256_set1_ps(x + 0.5f - v->cx), lanes), _mm256_set1_ps(v->sx));
+      __m256 uv = _mm256_fmadd_ps(u, u, vv), b = _mm256_fmadd_ps(u, tx, bv);
+      __m256 disc = _mm256_fnmadd_ps(cc, uv, _mm256_fmsub_ps(b, b, cc));
+      __m256 live = _mm256_cmp_ps(disc, zero, _CMP_GT_OQ);
+      if (x + 8 > area->x1)
+      {
+        live = _mm256_and_ps(live, _mm256_cmp_ps(lanes, _mm256_set1_ps(area->x1 - x), _CMP_LT_OQ));
+      }
+      if (_mm256_movemask_ps(live) == 0)
+      {
+        continue;
+      }
+      __m256 a = _mm256_add_ps(uv, one), ra = _mm256_div_ps(one, a);
+      __m256 root = _mm256_sqrt_ps(_mm256_max_ps(disc, zero));
+      __m256 t = _mm256_mul_ps(_mm256_sub_ps(b, root), ra), end = _mm256_mul_ps(_mm256_add_ps(b, root), ra);
+      __m256 stride = _mm256_mul_ps(_mm256_sqrt_ps(ra), size);
+      __m256 dx = _mm256_mul_ps(_mm256_fmadd_ps(u, m0, _mm256_fmadd_ps(rv, m3, m6)), inv),
+             dy = _mm256_mul_ps(_mm256_fmadd_ps(u, m1, _mm256_fmadd_ps(rv, m4, m7)), inv),
+             dz = _mm256_mul_ps(_mm256_fmadd_ps(u, m2, _mm256_fmadd_ps(rv, m5, m8)), inv);
+      __m256 px, py, pz, ring, dist = one, active = live;
+      for (int s = 0; s < RAY_STEPS; s++)
+      {
+        px = _mm256_fmadd_ps(t, dx, ox), py = _mm256_fmadd_ps(t, dy, oy), pz = _mm256_fmadd_ps(t, dz, oz);
+        ring = _mm256_sqrt_ps(_mm256_fmadd_ps(px, px, _mm256_mul_ps(py, py)));
+        __m256 r = _mm256_sub_ps(ring, two);
+        __m256 next = _mm256_sub_ps(_mm256_sqrt_ps(_mm256_fmadd_ps(r, r, _mm256_mul_ps(pz, pz))), one);
+        // Finished lanes keep their t, so p and ring are recomputed unchanged
+        dist = _mm256_blendv_ps(dist, next, active);
+        active = _mm256_and_ps(active, _mm256_and_ps(_mm256_cmp_ps(next, _mm256_mul_ps(cone, t), _CMP_GE_OQ),
+                                                     _mm256_cmp_ps(t, end, _CMP_LE_OQ)));
+        if (_mm256_movemask_ps(active) == 0 || s + 1 == RAY_STEPS)
+        {
+          break;
+        }
+        t = _mm256_blendv_ps(t, _mm256_fmadd_ps(next, stride, t), active);
+      }
+      __m256 hit = _mm256_and_ps(live, _mm256_and_ps(_mm256_cmp_ps(t, end, _CMP_LE_OQ),
+                                                     _mm256_cmp_ps(dist, _mm256_mul_ps(cone, t), _CMP_LT_OQ)));
+      unsigned mask = (unsigned)_mm256_movemask_ps(hit);
+      if (mask == 0)
+      {
+        continue;
+      }
+      __m256 k = _mm256_sub_ps(one, _mm256_div_ps(two, ring)), scale = _mm256_div_ps(one, _mm256_add_ps(dist, one));
+      __m256 nx = _mm256_mul_ps(_mm256_mul_ps(px, k), scale), ny = _mm256_mul_ps(_mm256_mul_ps(py, k), scale),
+             nz = _mm256_mul_ps(pz, scale);
+      __m256 sum = zero;
+      for (int l = 0; l < light->count; l++)
+      {
+        __m256 dot = _mm256_fmadd_ps(lx[l], nx, _mm256_fmadd_ps(ly[l], ny, _mm256_mul_ps(lz[l], nz)));
+        sum = _mm256_add_ps(sum, _mm256_max_ps(dot, zero));
+      }
+      __m256i q = _mm256_cvttps_epi32(_mm256_min_ps(_mm256_mul_ps(_mm256_div_ps(one, t), depthScale), dmax));
+      _mm256_storeu_si256((__m256i *)W, _mm256_or_si256(_mm256_slli_epi32(q, DEPTH_SHIFT),
+                                                        _mm256_or_si256(_mm256_min_epi32(_mm256_cvttps_epi32(sum), top), tag)));
+      int row = x + v->width * y;
+      while (mask)
+      {
+        int lane = __builtin_ctz(mask), o = row + lane;
+        mask &= mask - 1;
+        if (W[lane] > depth[o])
+        {
+          depth[o] = W[lane];
+          rasterPasses++;
+        }
+      }
+    }
+  }
+}
+#endif
+
+// Ray kernel matching a rasterizer kernel: the AVX2 one for the AVX2 and
+// AVX-512 rasterizers, otherwise the scalar one
+RayKernel findRayKernel(const KernelInfo *kernel)
+{
+#ifdef HAVE_X86_KERNELS
+  if ((strcmp(kernel->name, "avx2") == 0 || strcmp(kernel->name, "avx512") == 0) && __builtin_cpu_supports("avx2") &&
+      __builtin_cpu_supports("fma"))
+  {
+    return rayAVX2;
+  }
+#endif
+  return rayScalar;
+}
+
+// Current CLOCK_MONOTONIC time in nanoseconds
+long long nowNs()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// Rotation speeds in radians per second at speed factor 1.0 (the classic
+// 0.04 and 0.02 radians per frame at 30 FPS)
+#define SPIN_RATE_A 1.2
+#define SPIN_RATE_B 0.6
+
+// Frame scheduler: frames are due at fixed absolute CLOCK_MONOTONIC deadlines,
+// so time spent rendering and writing does not add to the frame period
+typedef struct
+{
+  long long period;      // Nanoseconds between frames
+  long long deadline;    // When the next frame is due
+  unsigned long missed;  // Deadlines that passed before the frame was ready
+  unsigned long skipped; // Frames dropped to catch up with the schedule
+} FrameScheduler;
+
+// Highest accepted --fps; the period stays well above a nanosecond
+#define MAX_FPS 1000
+
+// Frame period in nanoseconds for a rate: never 0, since the scheduler
+// divides by it, and at most 1000 s, so tiny rates cannot overflow
+long long framePeriod(double fps)
+{
+  double period = 1e9 / fps;
+  return period < 1 ? 1 : period > 1e12 ? 1000000000000LL : (long long)period;
+}
+
+void schedulerInit(FrameScheduler *s, double fps)
+{
+  s->period = framePeriod(fps);
+  s->deadline = nowNs() + s->period;
+  s->missed = 0;
+  s->skipped = 0;
+}
+
+// Changes the frame period from the next deadline on
+void schedulerSetRate(FrameScheduler *s, double fps)
+{
+  s->period = framePeriod(fps);
+}
+
+// Nanoseconds left until the next deadline (zero or negative when due)
+long long schedulerRemaining(const FrameScheduler *s)
+{
+  return s->deadline - nowNs();
+}
+
+// Makes the next frame due at once, after a pause or a lower rate
+void schedulerRestart(FrameScheduler *s)
+{
+  s->deadline = nowNs();
+}
+
+// Moves on to the next deadline once the current one is due and returns how
+// many frame periods the schedule advanced. That is 1 on schedule; when
+// deadlines were missed, the frames whose slots already passed are skipped
+// instead of being presented late. Waking up slightly after the deadline
+// (timer slack) does not count as a miss.
+int schedulerAdvance(FrameScheduler *s)
+{
+  int steps = 1;
+  long long late = nowNs() - s->deadline;
+  if (late > s->period / 8)
+  {
+    s->missed++;
+    steps += (int)(late / s->period);
+    s->skipped += (unsigned long)(steps - 1);
+  }
+  s->deadline += steps * s->period;
+  return steps;
+}
+
+// Fixed-size latency histograms with 4 buckets per power of two of
+// nanoseconds, from 1 ns to about 2 s. Each one has a single writer (the
+// frame loop, or the writer thread for flushes), so the counters are
+// plain relaxed loads and stores; any thread may read them meanwhile.
+#define HIST_BUCKETS 120
+#define HIST_LIMIT ((1LL << 31) - 1) // Longer times land in the last bucket
+
+typedef struct
+{
+  atomic_ulong count[HIST_BUCKETS];
+  atomic_ulong n;      // Values recorded
+  atomic_ullong total; // Their sum in nanoseconds
+  atomic_llong max;
+} Histogram;
+
+static inline int histBucket(long long ns)
+{
+  if (ns < 4)
+  {
+    return ns < 0 ? 0 : (int)ns;
+  }
+  ns = ns > HIST_LIMIT ? HIST_LIMIT : ns;
+  int e = 63 - __builtin_clzll((unsigned long long)ns);
+  return 4 * (e - 1) + (int)((ns >> (e - 2)) & 3);
+}
+
+// Smallest value that falls in bucket b
+static inline long long histLower(int b)
+{
+  return b < 4 ? b : (long long)(4 + b % 4) << (b / 4 - 1);
+}
+
+#define RELAXED_ADD(var, value) \
+  atomic_store_explicit(&(var), atomic_load_explicit(&(var), memory_order_relaxed) + (value), memory_order_relaxed)
+
+void histAdd(Histogram *h, long long ns)
+{
+  int b = histBucket(ns);
+  RELAXED_ADD(h->count[b], 1);
+  RELAXED_ADD(h->n, 1);
+  RELAXED_ADD(h->total, (unsigned long long)(ns > 0 ? ns : 0));
+  if (ns > atomic_load_explicit(&h->max, memory_order_relaxed))
+  {
+    atomic_store_explicit(&h->max, ns, memory_order_relaxed);
+  }
+}
+
+// Upper end of the bucket holding the given fraction of the values, so
+// the true percentile is at most 19% lower; 0 if there are none
+long long histPercentile(const Histogram *h, double fraction)
+{
+  unsigned long n = atomic_load_explicit(&h->n, memory_order_relaxed), seen = 0;
+  for (int b = 0; b < HIST_BUCKETS && n > 0; b++)
+  {
+    seen += atomic_load_explicit(&h->count[b], memory_order_relaxed);
+    if (seen >= fraction * n)
+    {
+      long long upper = b + 1 < HIST_BUCKETS ? histLower(b + 1) - 1 : HIST_LIMIT;
+      long long max = atomic_load_explicit(&h->max, memory_order_relaxed);
+      return upper < max ? upper : max;
+    }
+  }
+  return 0;
+}
+
+double histMean(const Histogram *h)
+{
+  unsigned long n = atomic_load_explicit(&h->n, memory_order_relaxed);
+  return n ? (double)atomic_load_explicit(&h->total, memory_order_relaxed) / n : 0;
+}
+
+// Phases of the frame loop that are timed (--stats, --stats-json)
+enum
+{
+  LOOP_INPUT,  // Handling keys and signals
+  LOOP_CLEAR,  // Clearing the buffers of the previous frame
+  LOOP_RASTER, // Rasterizing and composing the cells
+  LOOP_ENCODE, // Encoding (or copying a cached frame)
+  LOOP_FLUSH,  // From publishing a frame until the terminal took it
+  LOOP_PHASES
+};
+const char *loopPhaseNames[LOOP_PHASES] = {"input", "clear", "raster", "encode", "flush"};
+
+// Blocks the signals handled by the main loop and returns a signalfd that
+// reports them, so they are handled in the same wait as keyboard input
+int openSignalFd()
+{
+  sigset_t mask;
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGWINCH); // Terminal resized
+  sigaddset(&mask, SIGTERM);
+  sigaddset(&mask, SIGINT);
+  sigaddset(&mask, SIGHUP);  // Terminal closed
+  sigaddset(&mask, SIGTSTP); // Job control; Ctrl+Z itself arrives as a key in raw mode
+  sigaddset(&mask, SIGCONT);
+  if (sigprocmask(SIG_BLOCK, &mask, NULL) == -1)
+  {
+    return -1;
+  }
+  return signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+}
+
+// How a frame is rasterized: by projecting the torus samples (object
+// order) or by casting a ray per cell (image order)
+enum
+{
+  ENGINE_POINTS,
+  ENGINE_RAYCAST,
+  ENGINE_COUNT
+};
+const char *engineNames[ENGINE_COUNT] = {"points", "raycast"};
+
+// Upper limit for --threads
+#define MAX_THREADS 64
+
+// What the keys change while the donut runs; the loop applies the values
+// named in changed
+typedef struct
+{
+  double fps;    // Target frame rate
+  float density; // Sampling density, 0: classic steps
+  int depth;     // DEPTH_*, or -1 for auto
+  int engine;    // ENGINE_*
+  int threads;   // Rasterizer threads
+  int delta;     // Delta encoder instead of full repaints
+  int changed;   // SETTING_* not applied yet
+} Settings;
+
+enum
+{
+  SETTING_FPS = 1,
+  SETTING_DENSITY = 2,
+  SETTING_DEPTH = 4,
+  SETTING_ENGINE = 8,
+  SETTING_THREADS = 16,
+  SETTING_DELTA = 32
+};
+
+// Values the keys step the frame rate and the density through
+const double fpsSteps[] = {5, 10, 15, 20, 24, 30, 48, 60, 90, 120, 144, 240};
+const double densitySteps[] = {0, 0.25, 0.5, 1, 1.5, 2, 3, 4};
+#define STEP_COUNT(steps) ((int)(sizeof(steps) / sizeof((steps)[0])))
+
+// Returns the first step above (up) or below value, or value past the ends
+double nextStep(const double *steps, int count, double value, int up)
+{
+  for (int i = 0; i < count; i++)
+  {
+    double step = steps[up ? i : count - 1 - i];
+    if (up ? step > value : step < value)
+    {
+      return step;
+    }
+  }
+  return value;
+}
+
+// Applies the key binding of c, if it has one: +/- frame rate, </>
+// density, c color depth (truecolor, 256, 16, auto), e engine, t/T fewer
+// or more threads, d delta encoding on or off
+void settingsKey(Settings *s, char c)
+{
+  if (c == '+' || c == '=' || c == '-')
+  {
+    double fps = nextStep(fpsSteps, STEP_COUNT(fpsSteps), s->fps, c != '-');
+    s->changed |= fps != s->fps ? SETTING_FPS : 0;
+    s->fps = fps;
+  }
+  else if (c == '>' || c == '.' || c == '<' || c == ',')
+  {
+    float density = (float)nextStep(densitySteps, STEP_COUNT(densitySteps), s->density, c == '>' || c == '.');
+    s->changed |= density != s->density ? SETTING_DENSITY : 0;
+    s->density = density;
+  }
+  else if (c == 'c' || c == 'C')
+  {
+    s->depth = s->depth + 1 == DEPTH_COUNT ? -1 : s->depth + 1; // -1 (auto) wraps to 0
+    s->changed |= SETTING_DEPTH;
+  }
+  else if (c == 'e' || c == 'E')
+  {
+    s->engine = (s->engine + 1) % ENGINE_COUNT;
+    s->changed |= SETTING_ENGINE;
+  }
+  else if ((c == 't' && s->threads > 1) || (c == 'T' && s->threads < MAX_THREADS))
+  {
+    s->threads += c == 'T' ? 1 : -1;
+    s->changed |= SETTING_THREADS;
+  }
+  else if (c == 'd' || c == 'D')
+  {
+    s->delta = !s->delta;
+    s->changed |= SETTING_DELTA;
+  }
+}
+
+// What handleInput() saw, as bits
+enum
+{
+  INPUT_QUIT = 1,      // 'q', a lone ESC or a failed stdin
+  INPUT_KEY = 2,       // Any other key
+  INPUT_FOCUS_IN = 4,  // Focus report: the terminal got the focus
+  INPUT_FOCUS_OUT = 8, // Focus report: another window has it
+  INPUT_SUSPEND = 16   // Ctrl+Z, which raw mode does not turn into SIGTSTP
+};
+
+// Parses the escape sequence starting at s[0] (ESC): CSI (ESC [, parameter
+// bytes, a final byte), SS3 (ESC O and one byte) or a lone ESC. Terminals
+// write a sequence at once, so a lone ESC is one not followed by more input
+// in the same read; more says the read filled the buffer and input may
+// continue. Adds the INPUT_* bits and returns the length, or 0 if the
+// sequence is cut off at len and continues with the next read.
+size_t parseEscape(const char *s, size_t len, int more, int *events)
+{
+  size_t end; // Final byte
+  if (len > 1 && s[1] == '[')
+  {
+    for (end = 2; end < len && (s[end] < 0x40 || s[end] > 0x7E); end++)
+    {
+    }
+  }
+  else if (len > 1 && s[1] == 'O')
+  {
+    end = 2;
+  }
+  else if (len == 1 && more)
+  {
+    return 0;
+  }
+  else
+  {
+    *events |= INPUT_QUIT;
+    return 1;
+  }
+  if (end >= len)
+  {
+    return more ? 0 : len; // A truncated sequence without more input is dropped
+  }
+  if (end == 2 && s[1] == '[' && (s[2] == 'I' || s[2] == 'O'))
+  {
+    *events |= s[2] == 'I' ? INPUT_FOCUS_IN : INPUT_FOCUS_OUT;
+  }
+  else
+  {
+    *events |= INPUT_KEY; // Cursor and function keys
+  }
+  return end + 1;
+}
+
+// Drains pending keyboard input and returns the INPUT_* bits of what it
+// held. 's' toggles *overlay and the settingsKey() bindings change
+// *settings, if given.
+int handleInput(int *overlay, Settings *settings)
+{
+  char buf[64];
+  size_t kept = 0; // Start of a sequence cut off by the last read
+  int events = 0;
+  ssize_t n;
+  while (!(events & INPUT_QUIT) && (n = read(STDIN_FILENO, buf + kept, sizeof(buf) - kept)) > 0)
+  {
+    size_t len = kept + (size_t)n;
+    int more = len == sizeof(buf);
+    kept = 0;
+    for (size_t k = 0; k < len && !(events & INPUT_QUIT);)
+    {
+      if (buf[k] == 27) // ESC
+      {
+        size_t used = parseEscape(buf + k, len - k, more, &events);
+        if (used == 0)
+        {
+          kept = len - k;
+          memmove(buf, buf + k, kept);
+          break;
+        }
+        k += used;
+        continue;
+      }
+      char c = buf[k++];
+      if (c == 'q' || c == 'Q')
+      {
+        events |= INPUT_QUIT;
+      }
+      else if (c == 26) // Ctrl+Z
+      {
+        events |= INPUT_SUSPEND;
+      }
+      else
+      {
+        events |= INPUT_KEY;
+        if ((c == 's' || c == 'S') && overlay != NULL)
+        {
+          *overlay = !*overlay;
+        }
+        else if (settings != NULL)
+        {
+          settingsKey(settings, c);
+        }
+      }
+    }
+  }
+  if (n == -1 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+  {
+    // Error reading (except "no data available")
+    perror("read stdin failed"); // English error
+    events |= INPUT_QUIT;
+  }
+  return events;
+}
+
+// Drains the signalfd. Returns 1 if a termination signal arrived; sets
+// *resized on SIGWINCH, *stopped on SIGTSTP and *continued on SIGCONT.
+int handleSignals(int fd, int *resized, int *stopped, int *continued)
+{
+  struct signalfd_siginfo info;
+  int quit = 0;
+  while (read(fd, &info, sizeof(info)) == sizeof(info))
+  {
+    if (info.ssi_signo == SIGWINCH)
+    {
+      *resized = 1;
+    }
+    else if (info.ssi_signo == SIGTSTP)
+    {
+      *stopped = 1;
+    }
+    else if (info.ssi_signo == SIGCONT)
+    {
+      *continued = 1;
+    }
+    else
+    {
+      quit = 1;
+    }
+  }
+  return quit;
+}
+
+// Appends the glyph of cell c at p, preceded by its color escape if the
+// color state changes, and returns the new end. Blanks without a state keep
+// the current color since it is invisible on them. Without branches: the
+// escape and glyph are always copied (p needs 44 bytes of room) but only
+// kept as far as needed.
+static inline char *encodeCell(const CellTable *t, Cell c, int *current, char *p)
+{
+  int state = t->state[c];
+  int change = (state != 0) & (state != *current);
+  memcpy(p, t->escape[state], sizeof(t->escape[state]));
+  p += change ? t->escapeLen[state] : 0;
+  *current = change ? state : *current;
+  memcpy(p, t->glyph[c], sizeof(t->glyph[c]));
+  return p + t->glyphLen[c];
+}
+
+// Encodes the framebuffer into out and returns the number of bytes. Only
+// the cells in area are painted; the caller makes sure everything outside is
+// blank in b and on the terminal. A color escape is only emitted when the
+// palette level changes; blanks keep the current color since it is
+// invisible on them, and a single reset ends the frame.
+size_t encodeFrame(const Cell *b, int width, int height, const CellTable *t, Rect area, char *out)
+{
+  char *p = out;
+  int current = -1; // Active color state
+  int x0 = area.x0 > 1 ? area.x0 : 1; // Column 0 is never drawn
+
+  memcpy(p, "\x1b[H", 3); // Cursor to home position
+  p += 3;
+  for (int y = 0; y < height; y++)
+  {
+    const Cell *row = b + width * y;
+    *p = '\r';
+    p += t->crlf;
+    *p++ = '\n'; // Every row starts on a new line
+    if (y < area.y0 || y >= area.y1)
+    {
+      continue;
+    }
+    if (x0 > 1)
+    {
+      p += sprintf(p, "\x1b[%dC", x0 - 1); // Skip the blank columns
+    }
+    for (int x = x0; x < area.x1; x++)
+    {
+      p = encodeCell(t, row[x], &current, p);
+    }
+  }
+  *p = '\r';
+  p += t->crlf;
+  *p++ = '\n';
+  memcpy(p, "\x1b[0m", 4); // Reset color once per frame
+  p += 4;
+  return (size_t)(p - out);
+}
+
+// Shortest run of unchanged cells worth skipping with a cursor escape in the
+// delta encoder; shorter gaps are cheaper to repaint than to jump over.
+#define DELTA_MIN_GAP 8
+
+// Encodes only the cells that differ from prev, each changed run preceded by
+// a cursor positioning escape. Only the cells in area are compared, b and
+// prev must be equal outside. Returns the number of bytes, or 0 if the delta
+// would reach limit bytes, in which case a full repaint is cheaper.
+size_t encodeDelta(const Cell *b, const Cell *prev, int width, const CellTable *t, Rect area, char *out, size_t limit)
+{
+  char *p = out;
+  char *end = out + limit;
+  int current = -1; // Active color state
+  int x0 = area.x0 > 1 ? area.x0 : 1; // Column 0 holds the line break and is never drawn
+
+  for (int y = area.y0; y < area.y1; y++)
+  {
+    const Cell *row = b + width * y;
+    const Cell *prevRow = prev + width * y;
+    int x = x0;
+    while (x < area.x1)
+    {
+      if (row[x] == prevRow[x])
+      {
+        x++;
+        continue;
+      }
+      // Extend the run over changed cells and short unchanged gaps
+      int runEnd = x + 1;
+      for (int gap = 0; runEnd < area.x1 && DELTA_MIN_GAP > gap; runEnd++)
+      {
+        gap = (row[runEnd] == prevRow[runEnd]) ? gap + 1 : 0;
+      }
+      while (row[runEnd - 1] == prevRow[runEnd - 1])
+      {
+        runEnd--; // Drop the trailing unchanged cells of the run
+      }
+      // Row 0 of the framebuffer is printed on terminal line 2
+      p += sprintf(p, "\x1b[%d;%dH", y + 2, x);
+      for (; x < runEnd; x++)
+      {
+        p = encodeCell(t, row[x], &current, p);
+        if (p >= end)
+        {
+          return 0;
+        }
+      }
+    }
+  }
+  if (current >= 0)
+  {
+    memcpy(p, "\x1b[0m", 4);
+    p += 4;
+  }
+  return (size_t)(p - out);
+}
+
+// Framebuffers for the current terminal size, all carved out of one arena so
+// that no allocation happens per frame. The arena is only reallocated when a
+// resize needs more memory than it already has. The rasterizers draw into
+// the raster grid of the mode, which composeCells() turns into the cells
+// the encoders send.
+typedef struct
+{
+  int mode;           // MODE_*
+  int width, height;  // Framebuffer size in cells
+  Viewport view;      // Raster grid and projection onto it
+  uint32_t *depth;    // Depth word per raster point (depthWord()), 0 if empty
+  Cell *b;            // Framebuffer being rendered
+  Cell *prev;         // Framebuffer currently displayed
+  Rect zBox;          // Outside it depth is 0 (raster grid)
+  Rect bBox, prevBox; // Outside them b and prev are blank (cells)
+  char *out;          // Encoded frame
+  size_t outCap;      // Capacity of out (a full frame plus slack)
+  int tiles;          // Private depth tiles for extra worker threads
+  uint32_t *tile[MAX_THREADS - 1];
+  void *arena;        // Backing memory of all buffers above
+  size_t arenaSize;   // Size of arena
+} Frame;
+
+// Rounds a buffer size up to whole cache lines
+#define ARENA_ALIGN(n) (((n) + 63) & ~(size_t)63)
+
+// Sizes the framebuffers for a terminal of cols x rows characters in the
+// given mode, with one private tile per worker thread beyond the first, and
+// sets up the projection. Returns -1 if out of memory.
+int frameResize(Frame *f, int cols, int rows, int tiles, int mode)
+{
+  const RenderMode *m = &renderModes[mode];
+  int width = cols, height = rows - 2; // First and last line stay free
+  size_t cells = (size_t)width * height, points = cells * m->subX * m->subY;
+  // Every cell may need a color escape and a glyph, plus line breaks,
+  // cursor home, reset and slack for the delta encoder and the fixed-size
+  // copies of encodeCell()
+  size_t outCap = cells * m->cellBytes + 128;
+  size_t tileSize = ARENA_ALIGN(points * sizeof(uint32_t));
+  size_t size = tileSize * (1 + (size_t)tiles) + 2 * ARENA_ALIGN(cells * sizeof(Cell)) + ARENA_ALIGN(outCap);
+  if (size > f->arenaSize)
+  {
+    free(f->arena);
+    f->arena = aligned_alloc(64, size);
+    f->arenaSize = f->arena ? size : 0;
+    if (f->arena == NULL)
+    {
+      return -1;
+    }
+  }
+  char *p = f->arena;
+  f->depth = (uint32_t *)p;
+  p += tileSize;
+  f->b = (Cell *)p;
+  p += ARENA_ALIGN(cells * sizeof(Cell));
+  f->prev = (Cell *)p;
+  p += ARENA_ALIGN(cells * sizeof(Cell));
+  f->out = p;
+  f->outCap = outCap;
+  p += ARENA_ALIGN(outCap);
+  f->tiles = tiles;
+  for (int t = 0; t < tiles; t++)
+  {
+    f->tile[t] = (uint32_t *)p;
+    p += tileSize;
+  }
+
+  // Scale the classic 80x22 projection (center 40/12, scale 30/15) to the
+  // largest size that fits, keeping the 2:1 character aspect ratio
+  float scale = fminf(width / 80.0f, height / 22.0f);
+  f->mode = mode;
+  f->width = width;
+  f->height = height;
+  f->view.width = width * m->subX;
+  f->view.height = height * m->subY;
+  f->view.cx = width / 2 * m->subX;
+  f->view.cy = (height / 2 + 1) * m->subY;
+  f->view.sx = 30 * scale * m->subX;
+  f->view.sy = 15 * scale * m->subY;
+  // Nothing is known about the memory yet, so the first clear covers all
+  f->zBox = (Rect){0, 0, f->view.width, f->view.height};
+  f->bBox = f->prevBox = (Rect){0, 0, width, height};
+  return 0;
+}
+
+// Cells holding the raster points of area
+Rect cellArea(const Frame *f, Rect area)
+{
+  const RenderMode *m = &renderModes[f->mode];
+  return (Rect){area.x0 / m->subX, area.y0 / m->subY, (area.x1 + m->subX - 1) / m->subX,
+                (area.y1 + m->subY - 1) / m->subY};
+}
+
+// Turns the raster points of area into the codes of the cells they fall in
+// (for a cell table of the given number of shades) and returns those cells
+Rect composeCells(Frame *f, int shades, Rect area)
+{
+  const RenderMode *m = &renderModes[f->mode];
+  Rect cells = cellArea(f, area);
+  int width = f->view.width;
+  for (int y = cells.y0; y < cells.y1; y++)
+  {
+    Cell *row = f->b + f->width * y;
+    const uint32_t *top = f->depth + (size_t)width * y * m->subY;
+    for (int x = cells.x0; x < cells.x1; x++)
+    {
+      if (f->mode == MODE_CELLS)
+      {
+        row[x] = top[x] ? depthShade(top[x]) + 1 : 0;
+      }
+      else if (f->mode == MODE_HALF)
+      {
+        uint32_t upper = top[x], lower = top[x + width];
+        row[x] = (shades + 1) * (upper ? depthShade(upper) + 1 : 0) + (lower ? depthShade(lower) + 1 : 0);
+      }
+      else
+      {
+        // Braille dots 1-3 and 4-6 run down the left and right column,
+        // dots 7 and 8 are the bottom row. The nearest dot picks the
+        // palette.
+        static const unsigned char dot[4][2] = {{0x01, 0x08}, {0x02, 0x10}, {0x04, 0x20}, {0x40, 0x80}};
+        int mask = 0, sum = 0, count = 0;
+        uint32_t nearest = 0;
+        for (int dy = 0; dy < 4; dy++)
+        {
+          const uint32_t *point = top + (size_t)width * dy + 2 * x;
+          for (int dx = 0; dx < 2; dx++)
+          {
+            int set = point[dx] != 0;
+            mask |= set ? dot[dy][dx] : 0;
+            sum += depthLuminance(point[dx]);
+            count += set;
+            nearest = point[dx] > nearest ? point[dx] : nearest;
+          }
+        }
+        int palette = depthShade(nearest) - depthLuminance(nearest);
+        row[x] = count ? (palette + (sum + count / 2) / count) << 8 | mask : 0;
+      }
+    }
+  }
+  return cells;
+}
+
+// Largest terminal drawn; the buffers of a braille frame this size take
+// 64 MB per thread and the point indices stay well within an int
+#define MAX_COLS 2048
+#define MAX_ROWS 1024
+
+// Reads the terminal size, falling back to 80x24 when stdout is not a
+// terminal. Tiny terminals are treated as 8x6, huge ones as MAX_COLS x
+// MAX_ROWS.
+void terminalSize(int *cols, int *rows)
+{
+  struct winsize ws;
+  if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == -1 || ws.ws_col == 0 || ws.ws_row == 0)
+  {
+    ws.ws_col = 80;
+    ws.ws_row = 24;
+  }
+  *cols = ws.ws_col < 8 ? 8 : ws.ws_col > MAX_COLS ? MAX_COLS : ws.ws_col;
+  *rows = ws.ws_row < 6 ? 6 : ws.ws_row > MAX_ROWS ? MAX_ROWS : ws.ws_row;
+}
+
+// Writes the whole buffer, retrying on partial writes and interrupts
+int writeAll(int fd, const char *buf, size_t len)
+{
+  while (len > 0)
+  {
+    ssize_t n = write(fd, buf, len);
+    if (n == -1)
+    {
+      if (errno == EINTR)
+      {
+        continue;
+      }
+      return -1;
+    }
+    buf += n;
+    len -= (size_t)n;
+  }
+  return 0;
+}
+
+// Persistent worker threads. poolRun() wakes them for one job and returns
+// once every worker, including the calling thread as worker 0, is done.
+typedef struct
+{
+  int count;                            // Workers including the caller
+  pthread_t threads[MAX_THREADS - 1];   // Extra worker threads
+  pthread_mutex_t lock;
+  pthread_cond_t start, done;
+  unsigned long generation;             // Incremented for every job
+  int pending;                          // Extra workers still on the job
+  int stop;                             // Set to end the worker threads
+  void (*job)(void *ctx, int worker, int workers);
+  void *ctx;
+} ThreadPool;
+
+typedef struct
+{
+  ThreadPool *pool;
+  int index;
+} PoolWorker;
+
+PoolWorker poolWorkers[MAX_THREADS - 1];
+
+void *poolThread(void *arg)
+{
+  PoolWorker *w = arg;
+  ThreadPool *p = w->pool;
+  // Signals are handled by the main thread through its signalfd
+  sigset_t all;
+  sigfillset(&all);
+  pthread_sigmask(SIG_BLOCK, &all, NULL);
+
+  unsigned long seen = 0;
+  pthread_mutex_lock(&p->lock);
+  for (;;)
+  {
+    while (!p->stop && p->generation == seen)
+    {
+      pthread_cond_wait(&p->start, &p->lock);
+    }
+    if (p->stop)
+    {
+      break;
+    }
+    seen = p->generation;
+    pthread_mutex_unlock(&p->lock);
+    p->job(p->ctx, w->index, p->count);
+    pthread_mutex_lock(&p->lock);
+    if (--p->pending == 0)
+    {
+      pthread_cond_signal(&p->done);
+    }
+  }
+  pthread_mutex_unlock(&p->lock);
+  return NULL;
+}
+
+// Ends the worker threads and releases the lock and condition variables,
+// so the pool can be started again
+void poolStop(ThreadPool *p)
+{
+  pthread_mutex_lock(&p->lock);
+  p->stop = 1;
+  pthread_cond_broadcast(&p->start);
+  pthread_mutex_unlock(&p->lock);
+  for (int t = 0; t < p->count - 1; t++)
+  {
+    pthread_join(p->threads[t], NULL);
+  }
+  p->count = 1;
+  pthread_cond_destroy(&p->done);
+  pthread_cond_destroy(&p->start);
+  pthread_mutex_destroy(&p->lock);
+}
+
+// Starts threads - 1 extra workers. Returns -1 with errno set if a thread
+// could not be created; the ones already started are stopped again.
+int poolStart(ThreadPool *p, int threads)
+{
+  p->count = 1;
+  p->generation = 0;
+  p->pending = 0;
+  p->stop = 0;
+  pthread_mutex_init(&p->lock, NULL);
+  pthread_cond_init(&p->start, NULL);
+  pthread_cond_init(&p->done, NULL);
+  for (int t = 0; t < threads - 1; t++)
+  {
+    poolWorkers[t].pool = p;
+    poolWorkers[t].index = t + 1;
+    int err = pthread_create(&p->threads[t], NULL, poolThread, &poolWorkers[t]);
+    if (err != 0)
+    {
+      poolStop(p);
+      errno = err;
+      return -1;
+    }
+    p->count++;
+  }
+  return 0;
+}
+
+// Runs job(ctx, worker, workers) on every worker and waits for all of them
+void poolRun(ThreadPool *p, void (*job)(void *ctx, int worker, int workers), void *ctx)
+{
+  if (p->count > 1)
+  {
+    pthread_mutex_lock(&p->lock);
+    p->job = job;
+    p->ctx = ctx;
+    p->pending = p->count - 1;
+    p->generation++;
+    pthread_cond_broadcast(&p->start);
+    pthread_mutex_unlock(&p->lock);
+  }
+  job(ctx, 0, p->count);
+  if (p->count > 1)
+  {
+    pthread_mutex_lock(&p->lock);
+    while (p->pending > 0)
+    {
+      pthread_cond_wait(&p->done, &p->lock);
+    }
+    pthread_mutex_unlock(&p->lock);
+  }
+}
+
+// Encoded frames on their way to the terminal. The main thread fills and
+// publishes slots, a writer thread sends them in order, so a slow terminal
+// only delays the output and not rendering or input handling. Both sides
+// only advance their own counter, which makes the ring lock-free; the
+// eventfd wakes the writer when a frame is published.
+//
+// The output is non-blocking: a frame the terminal does not take at once
+// is finished when it is writable again. Frames queued behind it are
+// superseded by the next full repaint (a key frame), so a stalled terminal
+// gets the latest picture instead of a backlog. A frame that clears the
+// screen is never superseded: the key frames after it only repaint what
+// was drawn since the clear.
+#define RING_SLOTS 4 // Power of two, so the counters may wrap
+
+typedef struct
+{
+  char *buf;
+  size_t cap;
+  size_t len;
+  int key;            // Full repaint, does not depend on the frames before it
+  int clear;          // Clears the screen, so it is never skipped
+  long long published; // When the frame was handed to the writer
+} RingSlot;
+
+typedef struct
+{
+  RingSlot slots[RING_SLOTS];
+  atomic_uint head;    // Slots published by the producer
+  atomic_uint tail;    // Slots written (or superseded) by the writer
+  atomic_int stop;     // Set to end the writer thread
+  atomic_int failed;   // errno of a failed write, 0 if none
+  int wakeFd;          // eventfd signalled on publish and stop
+  int fd;              // Output file descriptor, non-blocking
+  pthread_t thread;
+  unsigned long dropped;      // Frames not rendered because the ring was full
+  atomic_ulong superseded;    // Queued frames skipped for a newer key frame
+  atomic_ulong eagain;        // Writes the terminal did not take at once
+  atomic_ullong written;      // Bytes the terminal took
+  atomic_llong latency;       // Sum of publish-to-written times of frames
+  atomic_ulong latencyFrames; // Frames summed up in latency
+  int stalled;                // Writer stopped in the middle of a frame
+  Histogram *flush;           // Publish-to-written times, or NULL
+} FrameRing;
+
+// Skips the queued frames before the newest queued key frame, but not past
+// a frame that clears the screen. Only called between frames, so a skipped
+// frame was never partially written.
+unsigned ringSkipSuperseded(FrameRing *r, unsigned tail, unsigned head)
+{
+  unsigned skip = tail;
+  for (unsigned i = tail + 1; i != head && !r->slots[(i - 1) % RING_SLOTS].clear; i++)
+  {
+    if (r->slots[i % RING_SLOTS].key)
+    {
+      skip = i;
+    }
+  }
+  if (skip != tail)
+  {
+    atomic_fetch_add_explicit(&r->superseded, skip - tail, memory_order_relaxed);
+    atomic_store_explicit(&r->tail, skip, memory_order_release);
+  }
+  return skip;
+}
+
+// Blocks until the output is writable or the eventfd is signalled, which
+// it then resets. Returns -1 on a poll error.
+int ringWait(FrameRing *r, int writable)
+{
+  struct pollfd fds[2] = {{r->wakeFd, POLLIN, 0}, {r->fd, POLLOUT, 0}};
+  if (poll(fds, writable ? 2 : 1, -1) == -1)
+  {
+    return errno == EINTR ? 0 : -1;
+  }
+  if (fds[0].revents & POLLIN)
+  {
+    uint64_t count;
+    if (read(r->wakeFd, &count, sizeof(count)) == -1 && errno != EAGAIN)
+    {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+void *ringThread(void *arg)
+{
+  FrameRing *r = arg;
+  sigset_t all;
+  sigfillset(&all);
+  pthread_sigmask(SIG_BLOCK, &all, NULL);
+
+  unsigned tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+  while (!atomic_load_explicit(&r->stop, memory_order_relaxed))
+  {
+    unsigned head = atomic_load_explicit(&r->head, memory_order_acquire);
+    if (tail == head)
+    {
+      if (ringWait(r, 0) == -1)
+      {
+        atomic_store(&r->failed, errno);
+        break;
+      }
+      continue;
+    }
+    tail = ringSkipSuperseded(r, tail, head);
+    RingSlot *s = &r->slots[tail % RING_SLOTS];
+    size_t done = 0;
+    while (done < s->len && !atomic_load_explicit(&r->stop, memory_order_relaxed))
+    {
+      ssize_t n = write(r->fd, s->buf + done, s->len - done);
+      if (n >= 0)
+      {
+        done += (size_t)n;
+        atomic_fetch_add_explicit(&r->written, (unsigned long long)n, memory_order_relaxed);
+      }
+      else if (errno == EAGAIN || errno == EWOULDBLOCK)
+      {
+        // Wakes up for every published frame too, so stop is seen in time
+        atomic_fetch_add_explicit(&r->eagain, 1, memory_order_relaxed);
+        if (ringWait(r, 1) == -1)
+        {
+          break;
+        }
+      }
+      else if (errno != EINTR)
+      {
+        break;
+      }
+    }
+    if (done < s->len)
+    {
+      r->stalled = 1;
+      if (!atomic_load(&r->stop))
+      {
+        atomic_store(&r->failed, errno);
+      }
+      break;
+    }
+    long long latency = nowNs() - s->published;
+    if (r->flush != NULL)
+    {
+      histAdd(r->flush, latency);
+    }
+    atomic_fetch_add_explicit(&r->latency, latency, memory_order_relaxed);
+    atomic_fetch_add_explicit(&r->latencyFrames, 1, memory_order_relaxed);
+    atomic_store_explicit(&r->tail, ++tail, memory_order_release);
+  }
+  return NULL;
+}
+
+// Allocates the slots with cap bytes each and starts the writer thread.
+// Returns -1 on failure.
+int ringStart(FrameRing *r, int fd, size_t cap)
+{
+  memset(r, 0, sizeof(*r));
+  r->fd = fd;
+  for (int i = 0; i < RING_SLOTS; i++)
+  {
+    if ((r->slots[i].buf = malloc(cap)) == NULL)
+    {
+      return -1;
+    }
+    r->slots[i].cap = cap;
+  }
+  r->wakeFd = eventfd(0, EFD_CLOEXEC);
+  if (r->wakeFd == -1 || pthread_create(&r->thread, NULL, ringThread, r) != 0)
+  {
+    return -1;
+  }
+  return 0;
+}
+
+// Returns the next free slot, grown to at least cap bytes, or NULL if the
+// writer is still busy with all of them (or the slot could not grow)
+RingSlot *ringAcquire(FrameRing *r, size_t cap)
+{
+  unsigned head = atomic_load_explicit(&r->head, memory_order_relaxed);
+  if (head - atomic_load_explicit(&r->tail, memory_order_acquire) == RING_SLOTS)
+  {
+    return NULL;
+  }
+  // The writer never touches unpublished slots, so they may be reallocated
+  RingSlot *s = &r->slots[head % RING_SLOTS];
+  if (s->cap < cap)
+  {
+    char *buf = realloc(s->buf, cap);
+    if (buf == NULL)
+    {
+      return NULL;
+    }
+    s->buf = buf;
+    s->cap = cap;
+  }
+  return s;
+}
+
+// Wakes the writer thread
+void ringWake(FrameRing *r)
+{
+  uint64_t one = 1;
+  // Only fails if the counter would overflow, and then the writer is awake
+  ssize_t n = write(r->wakeFd, &one, sizeof(one));
+  (void)n;
+}
+
+// Returns the number of published frames the writer has not finished
+unsigned ringPending(FrameRing *r)
+{
+  return atomic_load_explicit(&r->head, memory_order_relaxed) -
+         atomic_load_explicit(&r->tail, memory_order_acquire);
+}
+
+// Hands the acquired slot holding len bytes to the writer; key marks a
+// full repaint that may supersede the frames queued before it, clear one
+// that starts by clearing the screen
+void ringPublish(FrameRing *r, size_t len, int key, int clear)
+{
+  unsigned head = atomic_load_explicit(&r->head, memory_order_relaxed);
+  r->slots[head % RING_SLOTS].len = len;
+  r->slots[head % RING_SLOTS].key = key;
+  r->slots[head % RING_SLOTS].clear = clear;
+  r->slots[head % RING_SLOTS].published = nowNs();
+  atomic_store_explicit(&r->head, head + 1, memory_order_release);
+  ringWake(r);
+}
+
+// Stops the writer and frees the slots. Frames still queued are dropped.
+// A frame the terminal did not take is cut off, and what the terminal has
+// not read yet is discarded, so quitting does not wait for a stalled
+// terminal; CAN then ends an escape sequence that was cut in half.
+void ringStop(FrameRing *r)
+{
+  atomic_store(&r->stop, 1);
+  ringWake(r);
+  pthread_join(r->thread, NULL);
+  if (r->stalled)
+  {
+    tcflush(r->fd, TCOFLUSH);
+    ssize_t n = write(r->fd, "\x18\x1b[0m", 5);
+    (void)n; // Best effort, the terminal may still be stalled
+  }
+  close(r->wakeFd);
+  for (int i = 0; i < RING_SLOTS; i++)
+  {
+    free(r->slots[i].buf);
+  }
+}
+
+// Job control stop (SIGTSTP or Ctrl+Z): hands the terminal back to the
+// shell and stops the process the way SIGTSTP would have; returns once it
+// is continued, which also queues a SIGCONT for the signalfd. The writer
+// gets a moment to finish the frames queued in ring (if given), so they do
+// not land on the shell's output later.
+void suspendProcess(FrameRing *ring)
+{
+  for (int i = 0; ring != NULL && i < 20 && ringPending(ring) > 0; i++)
+  {
+    struct timespec pause = {0, 5000000};
+    nanosleep(&pause, NULL);
+  }
+  rawSuspended = rawMode;
+  disableRawMode();
+  // SIGTSTP is blocked for the signalfd: raise it again and let the
+  // default action take it
+  sigset_t stop;
+  sigemptyset(&stop);
+  sigaddset(&stop, SIGTSTP);
+  raise(SIGTSTP);
+  pthread_sigmask(SIG_UNBLOCK, &stop, NULL);
+  pthread_sigmask(SIG_BLOCK, &stop, NULL);
+}
+
+// Output quality steps from best to cheapest: every allowed color depth at
+// the full frame rate, then the smallest depth at lower frame rates
+#define QUALITY_STEPS 8
+#define CONTROL_WINDOW_NS 500000000LL // How often the controller decides
+
+typedef struct
+{
+  int depth;  // DEPTH_*
+  double fps; // Target frame rate
+} QualityStep;
+
+// Keeps the output within a bytes-per-second budget and what the terminal
+// manages to take. Every window it compares the bytes produced with the
+// budget and checks the writer for congestion (frames superseded or
+// dropped, or frames taking longer than two periods to be written), and
+// steps the quality down or, after a calm stretch, back up.
+typedef struct
+{
+  QualityStep steps[QUALITY_STEPS];
+  int count;                  // Steps in use
+  int current;                // Active step
+  long long budget;           // Bytes per second, 0 for no limit
+  double capacity;            // Bytes per second the terminal took when it fell behind, 0 if never
+  double rate[QUALITY_STEPS]; // Bytes per second last produced at each step, 0 if unknown
+  int calm;                   // Windows in a row without congestion
+  int settling;               // Ignore the window holding a step's first repaint
+  unsigned long stepsDown, stepsUp;
+  // Counters at the start of the current window
+  long long windowStart;
+  unsigned long long windowBytes, windowWritten;
+  unsigned long windowPressure, windowLatencyFrames;
+  long long windowLatency;
+} QualityController;
+
+// Sets up the steps: every color depth if depth is -1 (auto), otherwise
+// only that depth, then half, a quarter and an eighth of the frame rate
+void controllerInit(QualityController *c, int depth, double fps, long long budget)
+{
+  memset(c, 0, sizeof(*c));
+  c->budget = budget;
+  for (int d = 0; d < DEPTH_COUNT; d++)
+  {
+    if (depth == -1 || depth == d)
+    {
+      c->steps[c->count++] = (QualityStep){d, fps};
+    }
+  }
+  int cheapest = c->steps[c->count - 1].depth;
+  for (int divisor = 2; divisor <= 8 && fps / divisor >= 1; divisor *= 2)
+  {
+    c->steps[c->count++] = (QualityStep){cheapest, fps / divisor};
+  }
+  c->windowStart = nowNs();
+}
+
+// Called once per frame with the bytes produced so far. Returns 1 when the
+// active step changed.
+int controllerUpdate(QualityController *c, unsigned long long produced, FrameRing *ring)
+{
+  long long now = nowNs();
+  if (now - c->windowStart < CONTROL_WINDOW_NS)
+  {
+    return 0;
+  }
+  double seconds = (now - c->windowStart) * 1e-9;
+  unsigned long long written = atomic_load_explicit(&ring->written, memory_order_relaxed);
+  unsigned long pressure = atomic_load_explicit(&ring->superseded, memory_order_relaxed) + ring->dropped;
+  long long latency = atomic_load_explicit(&ring->latency, memory_order_relaxed);
+  unsigned long latencyFrames = atomic_load_explicit(&ring->latencyFrames, memory_order_relaxed);
+
+  double rate = (produced - c->windowBytes) / seconds;
+  double throughput = (written - c->windowWritten) / seconds;
+  double period = 1e9 / c->steps[c->current].fps;
+  int congested = pressure != c->windowPressure ||
+                  (latencyFrames > c->windowLatencyFrames &&
+                   (double)(latency - c->windowLatency) / (latencyFrames - c->windowLatencyFrames) > 2 * period);
+  int settling = c->settling;
+  c->settling = 0;
+  c->windowStart = now;
+  c->windowBytes = produced;
+  c->windowWritten = written;
+  c->windowPressure = pressure;
+  c->windowLatency = latency;
+  c->windowLatencyFrames = latencyFrames;
+  if (settling)
+  {
+    return 0;
+  }
+  c->rate[c->current] = rate;
+
+  if (congested)
+  {
+    c->capacity = throughput;
+  }
+  else if (c->capacity > 0)
+  {
+    c->capacity *= 1.1; // Probe for a terminal that got faster again
+  }
+  double limit = c->budget > 0 ? (double)c->budget : 0;
+  if (c->capacity > 0 && (limit == 0 || c->capacity < limit))
+  {
+    limit = c->capacity;
+  }
+
+  if ((congested || (limit > 0 && rate > limit)) && c->current + 1 < c->count)
+  {
+    c->current++;
+    c->stepsDown++;
+    c->calm = 0;
+    c->settling = 1;
+    return 1;
+  }
+  c->calm = congested ? 0 : c->calm + 1;
+  if (c->current > 0 && c->calm >= 4)
+  {
+    // Without a measurement for the better step, assume it costs twice as much
+    double expected = c->rate[c->current - 1] > 0 ? c->rate[c->current - 1] : 2 * rate;
+    if (limit == 0 || expected < 0.9 * limit)
+    {
+      c->current--;
+      c->stepsUp++;
+      c->calm = 0;
+      c->settling = 1;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// Frame rate while nobody seems to be watching, and how long the terminal
+// may take none of the queued output before that counts as nobody
+#define IDLE_FPS 2
+#define IDLE_BACKLOG_NS 1000000000LL
+
+// Why the loop runs at IDLE_FPS, as bits: another window has the focus, the
+// terminal is stuck, output goes to a file, or (the loop pauses) another
+// job owns the terminal
+enum
+{
+  IDLE_UNFOCUSED = 1,  // Focus reports said so; a key also counts as focus
+  IDLE_BACKLOG = 2,    // No output taken for IDLE_BACKLOG_NS
+  IDLE_REDIRECTED = 4, // stdout is a regular file or /dev/null
+  IDLE_BACKGROUND = 8  // Continued in the background: nothing is drawn or read
+};
+
+typedef struct
+{
+  int reasons;               // IDLE_* in effect
+  int allowed;               // IDLE_* that may take effect
+  unsigned long long written; // Bytes taken by the terminal at the last check
+  long long progress;         // When the writer last made progress or had nothing queued
+  long long since;            // When the reasons became non-empty
+  long long idleNs;           // Time spent throttled or paused before that
+  unsigned long focusLosses, backlogs;
+  unsigned long stops; // Job-control stops the process was continued from
+} IdleMonitor;
+
+void idleInit(IdleMonitor *m, int allowed)
+{
+  memset(m, 0, sizeof(*m));
+  m->allowed = allowed | IDLE_BACKGROUND; // Drawing over another job is never right
+  m->progress = nowNs();
+}
+
+// Sets reason to on (if allowed) and returns 1 if that changed whether the
+// loop is throttled
+int idleSet(IdleMonitor *m, int reason, int on)
+{
+  int reasons = on ? m->reasons | (reason & m->allowed) : m->reasons & ~reason;
+  int changed = !reasons != !m->reasons;
+  if (reasons & ~m->reasons & IDLE_UNFOCUSED)
+  {
+    m->focusLosses++;
+  }
+  if (reasons & ~m->reasons & IDLE_BACKLOG)
+  {
+    m->backlogs++;
+  }
+  if (changed && reasons)
+  {
+    m->since = nowNs();
+  }
+  else if (changed)
+  {
+    m->idleNs += nowNs() - m->since;
+  }
+  m->reasons = reasons;
+  return changed;
+}
+
+// Called once per frame: the terminal is backed up when the writer has had
+// frames queued without taking a byte of them for IDLE_BACKLOG_NS. Returns
+// 1 like idleSet().
+int idleUpdate(IdleMonitor *m, FrameRing *ring)
+{
+  long long now = nowNs();
+  unsigned long long written = atomic_load_explicit(&ring->written, memory_order_relaxed);
+  if (written != m->written || ringPending(ring) == 0)
+  {
+    m->written = written;
+    m->progress = now;
+  }
+  return idleSet(m, IDLE_BACKLOG, now - m->progress > IDLE_BACKLOG_NS);
+}
+
+// Feeds the INPUT_* bits of handleInput() in: focus reports, and any key
+// means someone is there, so the backlog timeout starts over. Returns 1
+// like idleSet().
+int idleInput(IdleMonitor *m, int events)
+{
+  int changed = 0;
+  if (events & INPUT_FOCUS_OUT)
+  {
+    changed |= idleSet(m, IDLE_UNFOCUSED, 1);
+  }
+  if (events & (INPUT_FOCUS_IN | INPUT_KEY))
+  {
+    changed |= idleSet(m, IDLE_UNFOCUSED, 0);
+  }
+  if (events & INPUT_KEY)
+  {
+    m->progress = nowNs();
+    changed |= idleSet(m, IDLE_BACKLOG, 0);
+  }
+  return changed;
+}
+
+// Applies a change of the idle reasons to the frame rate. The full rate is
+// the controller's current step; it takes effect at once, and the
+// controller ignores the window that spans the idle stretch.
+void idleApply(const IdleMonitor *m, FrameScheduler *s, QualityController *c)
+{
+  double fps = c->steps[c->current].fps;
+  schedulerSetRate(s, m->reasons ? fmin(fps, IDLE_FPS) : fps);
+  if (!m->reasons)
+  {
+    schedulerRestart(s);
+    c->settling = 1;
+  }
+}
+
+// One torus of the scene. The position is relative to the screen, so a
+// scene fills every terminal size alike.
+typedef struct
+{
+  float x, y;  // Center, from -1 (left and top edge) to 1 (right and bottom edge), off screen up to 2
+  float size;  // Scale of the classic torus, (0, 1]
+  float speed; // Rotation speed factor on top of the global one
+  int palette; // Index into Scene.palette
+} Instance;
+
+#define MAX_INSTANCES 32
+
+// The tori drawn in every frame. They share the precomputed samples, the
+// lights and the depth buffer; palette holds the distinct palettes of the
+// instances.
+typedef struct
+{
+  int count;
+  Instance instance[MAX_INSTANCES];
+  int palettes;
+  Palette palette[MAX_PALETTES];
+} Scene;
+
+// Builds the transform of instance in at the scene angles A and B (not
+// wrapped, each instance turns them by its speed) for viewport v, and its
+// rotation for the lights. Returns 0 without building them if the bounding
+// sphere (radius 3 size) lies wholly beyond one of the planes through the
+// eye and an edge of the drawable points.
+int instanceTransform(const Instance *in, const Viewport *v, double A, double B, float *rot, float *m)
+{
+  // Units are sx / 5 points across at the depth of 5 the tori sit at
+  float x = in->x * v->width / 2 * 5 / v->sx, y = in->y * v->height / 2 * 5 / v->sy, z = 5, radius = 3 * in->size;
+  float left = (1 - v->cx) / v->sx, right = (v->width - v->cx) / v->sx;
+  float top = (1 - v->cy) / v->sy, bottom = (v->height - v->cy) / v->sy;
+  if (left * z - x >= radius * sqrtf(1 + left * left) || x - right * z >= radius * sqrtf(1 + right * right) ||
+      top * z - y >= radius * sqrtf(1 + top * top) || y - bottom * z >= radius * sqrtf(1 + bottom * bottom))
+  {
+    return 0;
+  }
+  rotationMatrix((float)fmod(A * in->speed, 2 * M_PI), (float)fmod(B * in->speed, 2 * M_PI), rot);
+  for (int i = 0; i < 9; i++)
+  {
+    m[i] = rot[i] * in->size;
+  }
+  m[9] = x, m[10] = y, m[11] = z, m[12] = in->size;
+  return 1;
+}
+
+// Per-frame pipeline state: framebuffers, the selected kernel and encoder
+// and what the terminal currently shows. Shared by the interactive loop and
+// the benchmark.
+typedef struct
+{
+  Frame frame;                // Framebuffers for the current size
+  const TorusGeometry *torus; // Precomputed sample points, shared by all instances
+  const Scene *scene;         // The tori to draw
+  int engine;                 // ENGINE_*
+  RasterKernel raster;        // Selected rasterizer kernel
+  RayKernel ray;              // Ray kernel of the raycast engine
+  ThreadPool *pool;           // Workers sharing the rasterization
+  const Lighting *lights;     // View-space lights
+  int drawn;                  // Instances of the frame being rasterized that are on screen, with
+  float transform[MAX_INSTANCES][TRANSFORM_SIZE]; // their transforms,
+  Lighting shading[MAX_INSTANCES];                // the lights in their object space
+  Rect box[MAX_INSTANCES];                        // and the raster points they can cover
+  const CellTable *cells;     // Terminal output per cell value
+  int useDelta;               // Send only changed cells when that is smaller
+  int havePrev;               // frame.prev holds what the terminal shows
+  size_t fullBytes;           // Size of the latest full repaint
+  unsigned long deltaFrames;  // Frames encoded as a delta
+  int clearScreen;            // Clear the screen before the next repaint
+  Rect painted;               // Cells drawn since the screen was cleared
+  unsigned long rasterized;   // Frames rasterized so far
+  unsigned long long instances; // Instances drawn in them, not counting culled ones
+  unsigned long long samples; // Samples projected (or rays cast) so far
+  unsigned long long passes;  // Depth tests passed by them
+  unsigned long workerPasses[MAX_THREADS]; // Passes of the current frame per worker
+} Renderer;
+
+// Forgets what the terminal shows, so the next frame is a full repaint
+void rendererInvalidate(Renderer *r)
+{
+  r->havePrev = 0;
+  r->fullBytes = r->frame.outCap;
+}
+
+// Fills the cells of area in a width-wide buffer of size-byte cells with
+// the byte value
+static void clearRect(void *buf, size_t size, int width, Rect area, int value)
+{
+  for (int y = area.y0; y < area.y1; y++)
+  {
+    memset((char *)buf + ((size_t)width * y + area.x0) * size, value, (size_t)(area.x1 - area.x0) * size);
+  }
+}
+
+// Clears the depth buffer and framebuffer, only where earlier
+// frames left something
+void rendererClear(Renderer *r)
+{
+  Frame *f = &r->frame;
+  clearRect(f->depth, sizeof(uint32_t), f->view.width, f->zBox, 0); // No sample at any point
+  clearRect(f->b, sizeof(Cell), f->width, f->bBox, 0);       // Blank cells
+  f->bBox = f->zBox = RECT_EMPTY;
+}
+
+// Worker share of a multithreaded frame: a contiguous block of samples of
+// every instance drawn, rasterized into the framebuffer by worker 0 and
+// into a private tile by the others
+void rasterJob(void *ctx, int worker, int workers)
+{
+  Renderer *r = ctx;
+  const TorusGeometry *g = r->torus;
+  Frame *f = &r->frame;
+  int first = (int)((long long)g->count * worker / workers), last = (int)((long long)g->count * (worker + 1) / workers);
+  TorusGeometry slice = *g;
+  size_t offset = (size_t)first;
+  slice.count = last - first;
+  slice.px += offset, slice.py += offset, slice.pz += offset;
+  slice.nx += offset, slice.ny += offset, slice.nz += offset;
+  slice.ipx += offset, slice.ipy += offset, slice.ipz += offset;
+  slice.inx += offset, slice.iny += offset, slice.inz += offset;
+  unsigned long passes = rasterPasses;
+  if (worker == 0)
+  {
+    for (int d = 0; d < r->drawn; d++)
+    {
+      r->raster(&slice, r->transform[d], &r->shading[d], &f->view, f->depth);
+    }
+  }
+  else
+  {
+    // Only the points of the instances' boxes are merged, so only they are
+    // cleared, all before any is drawn as they may overlap
+    uint32_t *tile = f->tile[worker - 1];
+    for (int d = 0; d < r->drawn; d++)
+    {
+      clearRect(tile, sizeof(uint32_t), f->view.width, r->box[d], 0);
+    }
+    for (int d = 0; d < r->drawn; d++)
+    {
+      r->raster(&slice, r->transform[d], &r->shading[d], &f->view, tile);
+    }
+  }
+  r->workerPasses[worker] = rasterPasses - passes;
+}
+
+// Merges the worker tiles into the framebuffer over the boxes of the
+// instances drawn, each worker handling a block of rows of every box.
+// Keeping the larger packed word lets the nearest fragment win and, on
+// equal depth, the brighter luminance (then the higher palette) whatever
+// the sample order, so the result matches the single-threaded one exactly.
+// Where boxes overlap the points are merged twice, to the same result.
+void mergeJob(void *ctx, int worker, int workers)
+{
+  Renderer *r = ctx;
+  Frame *f = &r->frame;
+  for (int d = 0; d < r->drawn; d++)
+  {
+    Rect box = r->box[d];
+    int rows = box.y1 - box.y0;
+    int first = box.y0 + rows * worker / workers, last = box.y0 + rows * (worker + 1) / workers;
+    for (int t = 0; t < workers - 1; t++)
+    {
+      const uint32_t *tile = f->tile[t];
+      for (int y = first; y < last; y++)
+      {
+        uint32_t *row = f->depth + (size_t)f->view.width * y;
+        const uint32_t *tileRow = tile + (size_t)f->view.width * y;
+        for (int x = box.x0; x < box.x1; x++)
+        {
+          row[x] = tileRow[x] > row[x] ? tileRow[x] : row[x];
+        }
+      }
+    }
+  }
+}
+
+// Worker share of a raycast frame: the rows y with y % workers == worker.
+// Rays do not overlap, so the workers write straight into the framebuffer,
+// even where the boxes of instances do; interleaved rows keep the load
+// even, as only the middle rows of a box hit its torus.
+void raycastJob(void *ctx, int worker, int workers)
+{
+  Renderer *r = ctx;
+  Frame *f = &r->frame;
+  unsigned long passes = rasterPasses;
+  for (int d = 0; d < r->drawn; d++)
+  {
+    const Rect *box = &r->box[d];
+    r->ray(r->transform[d], &r->shading[d], &f->view, box, f->depth,
+           box->y0 + ((worker - box->y0) % workers + workers) % workers, workers);
+  }
+  r->workerPasses[worker] = rasterPasses - passes;
+}
+
+// Turns every torus of the scene by its share of the angles A and B (not
+// wrapped), rasterizes those on screen into the raster grid and composes
+// the framebuffer cells from it. Culled instances cost nothing beyond the
+// test of their bounding sphere.
+void rendererRasterize(Renderer *r, double A, double B)
+{
+  Frame *f = &r->frame;
+  r->drawn = 0;
+  for (int i = 0; i < r->scene->count; i++)
+  {
+    const Instance *in = &r->scene->instance[i];
+    float rot[9], *m = r->transform[r->drawn];
+    if (!instanceTransform(in, &f->view, A, B, rot, m))
+    {
+      continue;
+    }
+    Rect box = torusBounds(m, &f->view);
+    if (box.x0 >= box.x1)
+    {
+      continue;
+    }
+    lightingToObject(r->lights, rot, in->palette, &r->shading[r->drawn]);
+    r->box[r->drawn++] = box;
+    f->zBox = rectUnion(f->zBox, box);
+  }
+  r->rasterized++;
+  r->instances += (unsigned long long)r->drawn;
+  if (r->drawn == 0)
+  {
+    return;
+  }
+  int workers = r->pool == NULL ? 1 : r->pool->count;
+  if (r->engine == ENGINE_RAYCAST)
+  {
+    if (workers == 1)
+    {
+      raycastJob(r, 0, 1);
+    }
+    else
+    {
+      poolRun(r->pool, raycastJob, r);
+    }
+    for (int d = 0; d < r->drawn; d++)
+    {
+      r->samples += (unsigned long long)(r->box[d].x1 - r->box[d].x0) * (r->box[d].y1 - r->box[d].y0);
+    }
+  }
+  else if (workers == 1)
+  {
+    unsigned long passes = rasterPasses;
+    for (int d = 0; d < r->drawn; d++)
+    {
+      r->raster(r->torus, r->transform[d], &r->shading[d], &f->view, f->depth);
+    }
+    r->workerPasses[0] = rasterPasses - passes;
+    r->samples += (unsigned long long)r->torus->count * r->drawn;
+  }
+  else
+  {
+    poolRun(r->pool, rasterJob, r);
+    poolRun(r->pool, mergeJob, r);
+    r->samples += (unsigned long long)r->torus->count * r->drawn;
+  }
+  for (int w = 0; w < workers; w++)
+  {
+    r->passes += r->workerPasses[w];
+  }
+  // Once all are drawn, as they may overlap
+  for (int d = 0; d < r->drawn; d++)
+  {
+    f->bBox = rectUnion(f->bBox, composeCells(f, r->cells->shades, r->box[d]));
+  }
+}
+
+// Cells any torus of the scene can cover at the angles A and B
+Rect sceneBounds(const Renderer *r, double A, double B)
+{
+  Rect area = RECT_EMPTY;
+  for (int i = 0; i < r->scene->count; i++)
+  {
+    float rot[9], m[TRANSFORM_SIZE];
+    if (instanceTransform(&r->scene->instance[i], &r->frame.view, A, B, rot, m))
+    {
+      area = rectUnion(area, cellArea(&r->frame, torusBounds(m, &r->frame.view)));
+    }
+  }
+  return area;
+}
+
+// Encodes the framebuffer into out, which holds at least frame.outCap
+// bytes: only the changes if that is smaller than a full repaint. Returns
+// the number of bytes. The delta compares the boxes of this frame and the
+// shown one; a full repaint covers everything drawn since the last clear,
+// as the terminal may show any of it.
+size_t rendererEncode(Renderer *r, char *out)
+{
+  Frame *f = &r->frame;
+  size_t bytes = 0;
+  if (r->useDelta && r->havePrev && !r->clearScreen)
+  {
+    size_t limit = r->fullBytes < f->outCap - 64 ? r->fullBytes : f->outCap - 64;
+    bytes = encodeDelta(f->b, f->prev, f->width, r->cells, rectUnion(f->bBox, f->prevBox), out, limit);
+    r->deltaFrames += bytes > 0;
+  }
+  if (bytes == 0)
+  {
+    size_t clear = 0;
+    if (r->clearScreen)
+    {
+      // Part of the frame, so all output goes through a single writer
+      memcpy(out, "\x1b[2J", 4);
+      clear = 4;
+      r->clearScreen = 0;
+      r->painted = RECT_EMPTY;
+    }
+    bytes = clear + encodeFrame(f->b, f->width, f->height, r->cells, rectUnion(r->painted, f->bBox),
+                                out + clear);
+    r->fullBytes = bytes;
+  }
+  r->painted = rectUnion(r->painted, f->bBox);
+  return bytes;
+}
+
+// Marks the encoded frame as shown; it becomes the reference for the next
+// delta
+void rendererPresented(Renderer *r)
+{
+  Cell *shown = r->frame.b;
+  Rect shownBox = r->frame.bBox;
+  r->frame.b = r->frame.prev;
+  r->frame.prev = shown;
+  r->frame.bBox = r->frame.prevBox;
+  r->frame.prevBox = shownBox;
+  r->havePrev = 1;
+}
+
+// One full turn of the animation, rendered and encoded once and then only
+// replayed. Frame k has the angles B = 2 pi k / frames and A = 2 B
+// (SPIN_RATE_A is twice SPIN_RATE_B), so both wrap exactly after the last
+// frame and the loop is seamless, as long as every instance turns a whole
+// number of times. Every frame is stored as a full repaint
+// and as a delta from the frame before it, back to back in one buffer; a
+// cache file holds the same layout and is used through mmap.
+typedef struct
+{
+  uint64_t fullOffset, fullLength;   // Full repaint in data
+  uint64_t deltaOffset, deltaLength; // Changes from the previous frame
+} CacheEntry;
+
+typedef struct
+{
+  char magic[8];     // CACHE_MAGIC
+  uint64_t key;      // cacheKey() of the parameters the frames were made for
+  uint64_t frames;   // Entries following the header
+  uint64_t dataSize; // Bytes of encoded frames following the entries
+} CacheHeader;
+
+#define CACHE_MAGIC "DONUTC1"
+
+typedef struct
+{
+  int frames;            // Frames in the cycle, 0 if not built yet
+  const CacheEntry *entries;
+  const char *data;
+  size_t dataSize;
+  size_t maxLength;      // Largest encoded frame
+  void *block;           // Memory holding entries and data, or NULL
+  void *map;             // Mapped cache file holding them, or NULL
+  size_t mapSize;
+  long long buildNs;     // Time it took to build, 0 if loaded from a file
+} FrameCache;
+
+// Number of frames for one turn at the given rate and speed factor
+int cycleFrames(double fps, float speedFactor)
+{
+  int frames = (int)lround(fps * 2 * M_PI / (SPIN_RATE_B * speedFactor));
+  return frames < 2 ? 2 : frames;
+}
+
+// Frame of the built turn that shows the angles at elapsed seconds (times
+// the speed factor)
+int cacheFrameAt(const FrameCache *c, double elapsed)
+{
+  double turn = fmod(elapsed * SPIN_RATE_B / (2 * M_PI), 1.0);
+  return (int)(turn * c->frames) % c->frames;
+}
+
+// FNV-1a hash of everything the encoded frames depend on
+uint64_t cacheKey(const Renderer *r, int frames)
+{
+  // Rays only depend on the size, samples on their count
+  int params[7] = {r->frame.width, r->frame.height, r->frame.mode, frames, r->engine,
+                   r->engine == ENGINE_RAYCAST ? 0 : r->torus->count, r->scene->count};
+  uint64_t hash = 14695981039346656037ULL;
+  const unsigned char *parts[4] = {(const unsigned char *)params, (const unsigned char *)r->cells,
+                                   (const unsigned char *)r->lights, (const unsigned char *)r->scene->instance};
+  size_t sizes[4] = {sizeof(params), sizeof(*r->cells), sizeof(*r->lights), sizeof(Instance) * r->scene->count};
+  for (int part = 0; part < 4; part++)
+  {
+    for (size_t i = 0; i < sizes[part]; i++)
+    {
+      hash = (hash ^ parts[part][i]) * 1099511628211ULL;
+    }
+  }
+  return hash;
+}
+
+void cacheRelease(FrameCache *c)
+{
+  free(c->block);
+  if (c->map != NULL)
+  {
+    munmap(c->map, c->mapSize);
+  }
+  memset(c, 0, sizeof(*c));
+}
+
+// Maps the cache file if it holds frames for key. Returns -1 if not.
+int cacheLoad(FrameCache *c, const char *path, uint64_t key, int frames)
+{
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1)
+  {
+    return -1;
+  }
+  struct stat st;
+  void *map = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(CacheHeader))
+  {
+    map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  }
+  close(fd);
+  if (map == MAP_FAILED)
+  {
+    return -1;
+  }
+  // The sizes are untrusted, so they are checked by subtraction, which
+  // cannot wrap around
+  const CacheHeader *h = map;
+  size_t entriesSize = sizeof(CacheEntry) * (size_t)frames;
+  if (memcmp(h->magic, CACHE_MAGIC, sizeof(h->magic)) != 0 || h->key != key || h->frames != (uint64_t)frames ||
+      (size_t)st.st_size - sizeof(*h) < entriesSize || h->dataSize != (size_t)st.st_size - sizeof(*h) - entriesSize)
+  {
+    munmap(map, (size_t)st.st_size);
+    return -1;
+  }
+  c->map = map;
+  c->mapSize = (size_t)st.st_size;
+  c->entries = (const CacheEntry *)(h + 1);
+  c->data = (const char *)c->entries + entriesSize;
+  c->dataSize = h->dataSize;
+  c->frames = frames;
+  c->maxLength = 0;
+  for (int k = 0; k < frames; k++)
+  {
+    const CacheEntry *e = &c->entries[k];
+    if (e->fullLength > c->dataSize || e->fullOffset > c->dataSize - e->fullLength ||
+        e->deltaLength > c->dataSize || e->deltaOffset > c->dataSize - e->deltaLength)
+    {
+      cacheRelease(c); // Damaged file, build the frames again
+      return -1;
+    }
+    c->maxLength = e->fullLength > c->maxLength ? e->fullLength : c->maxLength;
+  }
+  return 0;
+}
+
+// Writes the cache so later runs with the same parameters can map it. The
+// file is replaced atomically, so a concurrent reader never sees half of it.
+int cacheSave(const FrameCache *c, const char *path, uint64_t key)
+{
+  char tmp[4096];
+  snprintf(tmp, sizeof(tmp), "%s.%d.tmp", path, (int)getpid());
+  FILE *file = fopen(tmp, "wb");
+  if (file == NULL)
+  {
+    return -1;
+  }
+  CacheHeader h = {CACHE_MAGIC, key, (uint64_t)c->frames, c->dataSize};
+  int ok = fwrite(&h, sizeof(h), 1, file) == 1 &&
+           fwrite(c->entries, sizeof(CacheEntry), (size_t)c->frames, file) == (size_t)c->frames &&
+           fwrite(c->data, 1, c->dataSize, file) == c->dataSize;
+  if (fclose(file) != 0 || !ok || rename(tmp, path) == -1)
+  {
+    unlink(tmp);
+    return -1;
+  }
+  return 0;
+}
+
+// Renders and encodes all frames of the cycle with the renderer's kernel,
+// threads and colors. Returns -1 if out of memory.
+int cacheBuild(FrameCache *c, Renderer *r, int frames)
+{
+  long long start = nowNs();
+  Frame *f = &r->frame;
+  int width = f->width, height = f->height;
+  size_t cells = (size_t)width * height;
+  size_t entriesSize = sizeof(CacheEntry) * (size_t)frames;
+  size_t cap = entriesSize + 2 * f->outCap;
+  char *block = malloc(cap);
+  Cell *first = malloc(cells * sizeof(Cell)); // Frame 0, the successor of the last frame
+  if (block == NULL || first == NULL)
+  {
+    free(block);
+    free(first);
+    return -1;
+  }
+  // A full repaint may follow any frame of the turn, and a delta may span
+  // the wrap, so both cover what any frame can cover
+  Rect area = RECT_EMPTY;
+  for (int k = 0; k < frames; k++)
+  {
+    double B = 2 * M_PI * k / frames;
+    area = rectUnion(area, sceneBounds(r, 2 * B, B));
+  }
+  size_t size = entriesSize, maxLength = 0;
+  for (int k = 0; k <= frames; k++)
+  {
+    // Room for a full repaint and a delta, both at most outCap
+    if (cap - size < 2 * f->outCap)
+    {
+      char *grown = realloc(block, cap * 2);
+      if (grown == NULL)
+      {
+        free(block);
+        free(first);
+        return -1;
+      }
+      block = grown;
+      cap *= 2;
+    }
+    CacheEntry *e = (CacheEntry *)block + (k % frames);
+    const Cell *grid = f->b;
+    if (k < frames)
+    {
+      double B = 2 * M_PI * k / frames;
+      rendererClear(r);
+      rendererRasterize(r, 2 * B, B);
+      e->fullOffset = size - entriesSize;
+      e->fullLength = encodeFrame(f->b, width, height, r->cells, area, block + size);
+      size += e->fullLength;
+      maxLength = e->fullLength > maxLength ? e->fullLength : maxLength;
+    }
+    else
+    {
+      grid = first; // Wrap around from the last frame to the first
+    }
+    if (k == 0)
+    {
+      memcpy(first, f->b, cells * sizeof(Cell));
+    }
+    else
+    {
+      size_t n = encodeDelta(grid, f->prev, width, r->cells, area, block + size, e->fullLength);
+      e->deltaOffset = n > 0 ? size - entriesSize : e->fullOffset;
+      e->deltaLength = n > 0 ? n : e->fullLength;
+      size += n;
+    }
+    rendererPresented(r);
+  }
+  free(first);
+  rendererInvalidate(r); // Nothing of this reached the terminal
+
+  char *shrunk = realloc(block, size);
+  c->block = shrunk ? shrunk : block;
+  c->entries = c->block;
+  c->data = (const char *)c->block + entriesSize;
+  c->dataSize = size - entriesSize;
+  c->maxLength = maxLength;
+  c->frames = frames;
+  c->buildNs = nowNs() - start;
+  return 0;
+}
+
+// Copies frame k into out: the delta if the terminal shows frame k - 1,
+// otherwise the full repaint. Returns the number of bytes.
+size_t cacheCopy(const FrameCache *c, int k, int fromPrevious, char *out)
+{
+  const CacheEntry *e = &c->entries[k];
+  uint64_t offset = fromPrevious ? e->deltaOffset : e->fullOffset;
+  uint64_t length = fromPrevious ? e->deltaLength : e->fullLength;
+  memcpy(out, c->data + offset, length);
+  return length;
+}
+
+// Returns 1 if name is one of the entries of the comma-separated list
+int listContains(const char *list, const char *name)
+{
+  size_t len = strlen(name);
+  for (const char *p = list; p != NULL; p = strchr(p, ','))
+  {
+    p += (*p == ',');
+    if (strncmp(p, name, len) == 0 && (p[len] == ',' || p[len] == '\0'))
+    {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// Benchmark phases, timed separately for every frame
+enum
+{
+  PHASE_CLEAR,
+  PHASE_RASTER,
+  PHASE_ENCODE,
+  PHASE_WRITE,
+  PHASE_TOTAL,
+  PHASE_COUNT
+};
+const char *phaseNames[PHASE_COUNT] = {"clear", "rasterize", "encode", "write", "total"};
+
+int compareLongLong(const void *a, const void *b)
+{
+  long long x = *(const long long *)a, y = *(const long long *)b;
+  return (x > y) - (x < y);
+}
+
+// Renders the given number of frames as fast as possible with the
+// renderer's kernel and encoder and prints mean/p50/p99 nanoseconds per
+// phase. The output goes to sinkFd, or is copied into memory if sinkFd is
+// -1. Returns -1 on failure.
+int benchmarkRun(Renderer *r, const char *kernelName, int frames, int sinkFd, char *sinkBuf)
+{
+  long long *samples = malloc(sizeof(long long) * PHASE_COUNT * (size_t)frames);
+  if (samples == NULL)
+  {
+    perror("malloc failed");
+    return -1;
+  }
+  unsigned long long bytes = 0;
+  rendererInvalidate(r);
+  r->deltaFrames = 0;
+  for (int i = 0; i < frames; i++)
+  {
+    long long *t = samples + (size_t)i * PHASE_COUNT;
+    long long t0 = nowNs();
+    rendererClear(r);
+    long long t1 = nowNs();
+    // Fixed steps per frame, as in the classic loop, so runs are comparable
+    rendererRasterize(r, fmodf(0.04f * i, 2 * M_PI), fmodf(0.02f * i, 2 * M_PI));
+    long long t2 = nowNs();
+    size_t n = rendererEncode(r, r->frame.out);
+    long long t3 = nowNs();
+    if (sinkFd == -1)
+    {
+      memcpy(sinkBuf, r->frame.out, n);
+    }
+    else if (writeAll(sinkFd, r->frame.out, n) == -1)
+    {
+      perror("write failed");
+      free(samples);
+      return -1;
+    }
+    rendererPresented(r);
+    long long t4 = nowNs();
+    bytes += n;
+    t[PHASE_CLEAR] = t1 - t0;
+    t[PHASE_RASTER] = t2 - t1;
+    t[PHASE_ENCODE] = t3 - t2;
+    t[PHASE_WRITE] = t4 - t3;
+    t[PHASE_TOTAL] = t4 - t0;
+  }
+
+  // Gather each phase into one column and sort it for the percentiles
+  long long *column = malloc(sizeof(long long) * (size_t)frames);
+  if (column == NULL)
+  {
+    perror("malloc failed");
+    free(samples);
+    return -1;
+  }
+  const char *encoder = r->useDelta ? "delta" : "full";
+  long long totalMean = 0;
+  for (int phase = 0; phase < PHASE_COUNT; phase++)
+  {
+    long long sum = 0;
+    for (int i = 0; i < frames; i++)
+    {
+      column[i] = samples[(size_t)i * PHASE_COUNT + phase];
+      sum += column[i];
+    }
+    qsort(column, (size_t)frames, sizeof(long long), compareLongLong);
+    long long mean = sum / frames;
+    totalMean = mean;
+    printf("%-8s %-7s %-10s %10lld %10lld %10lld\n", kernelName, encoder, phaseNames[phase],
+           mean, column[frames / 2], column[(int)((frames - 1) * 0.99)]);
+  }
+  printf("%-8s %-7s %-10s %10.1f fps, %.0f bytes/frame, %lu delta frames\n", kernelName, encoder, "summary",
+         totalMean > 0 ? 1e9 / totalMean : 0.0, (double)bytes / frames, r->deltaFrames);
+  free(column);
+  free(samples);
+  return 0;
+}
+
+// Rasterizes the benchmark frames with the renderer's engine and kernel and
+// with the reference kernel of the points engine and prints how many
+// covered raster points differ, in coverage or in luminance, and the largest
+// luminance difference. The points engine must match within one luminance
+// level. Returns 1 if it does not, -1 if out of memory.
+int benchmarkAccuracy(Renderer *r, const char *kernelName, RasterKernel reference, int frames)
+{
+  Frame *f = &r->frame;
+  size_t cells = (size_t)f->view.width * f->view.height;
+  uint32_t *expected = malloc(cells * sizeof(uint32_t));
+  if (expected == NULL)
+  {
+    perror("malloc failed");
+    return -1;
+  }
+  RasterKernel kernel = r->raster;
+  int engine = r->engine;
+  unsigned long covered = 0, coverage = 0, luminance = 0, far = 0;
+  int maxDiff = 0;
+  for (int i = 0; i < frames; i++)
+  {
+    float A = fmodf(0.04f * i, 2 * M_PI), B = fmodf(0.02f * i, 2 * M_PI);
+    r->raster = reference;
+    r->engine = ENGINE_POINTS;
+    rendererClear(r);
+    rendererRasterize(r, A, B);
+    memcpy(expected, f->depth, cells * sizeof(uint32_t));
+    r->raster = kernel;
+    r->engine = engine;
+    rendererClear(r);
+    rendererRasterize(r, A, B);
+    for (size_t o = 0; o < cells; o++)
+    {
+      int want = depthLuminance(expected[o]), got = depthLuminance(f->depth[o]);
+      covered += expected[o] != 0;
+      if ((expected[o] == 0) != (f->depth[o] == 0))
+      {
+        coverage++;
+      }
+      else if (want != got)
+      {
+        int diff = want > got ? want - got : got - want;
+        luminance++;
+        far += diff > 1;
+        maxDiff = diff > maxDiff ? diff : maxDiff;
+      }
+    }
+  }
+  double percent = 100.0 / (covered ? covered : 1);
+  printf("%-8s %-7s %-10s %.3f%% coverage, %.3f%% luminance (%.3f%% by more than 1, max %d) differs in %lu of %lu covered cells\n",
+         kernelName, "-", "accuracy", coverage * percent, luminance * percent, far * percent, maxDiff,
+         coverage + luminance, covered);
+  r->raster = kernel;
+  r->engine = engine;
+  free(expected);
+  if (far > 0 && engine == ENGINE_POINTS)
+  {
+    fprintf(stderr, "Error: Kernel '%s' is off by more than one luminance level in %lu cells.\n", kernelName, far);
+    return 1;
+  }
+  return 0;
+}
+
+// Runs benchmarkRun() for every combination of the comma-separated kernel
+// and encoder lists ("all" for every supported kernel or both encoders).
+// Returns 1 if a kernel failed benchmarkAccuracy(), -1 on errors.
+int benchmark(Renderer *r, const char *kernels, const char *encoders, int frames, const char *sink)
+{
+  // Reject misspelled list entries instead of silently skipping them
+  char list[256];
+  snprintf(list, sizeof(list), "%s", kernels);
+  for (char *name = strtok(list, ","); name != NULL; name = strtok(NULL, ","))
+  {
+    if (strcmp(name, "all") != 0 && findRasterKernel(name) == NULL)
+    {
+      fprintf(stderr, "Error: Unknown kernel '%s'. Available: ", name);
+      printRasterKernels(stderr);
+      fprintf(stderr, "\n");
+      return -1;
+    }
+  }
+  snprintf(list, sizeof(list), "%s", encoders);
+  for (char *name = strtok(list, ","); name != NULL; name = strtok(NULL, ","))
+  {
+    if (strcmp(name, "all") != 0 && strcmp(name, "delta") != 0 && strcmp(name, "full") != 0)
+    {
+      fprintf(stderr, "Error: Unknown encoder '%s'. Available: delta, full\n", name);
+      return -1;
+    }
+  }
+
+  int sinkFd = -1;
+  char *sinkBuf = NULL;
+  if (strcmp(sink, "null") == 0)
+  {
+    sinkFd = open("/dev/null", O_WRONLY);
+    if (sinkFd == -1)
+    {
+      perror("open /dev/null failed");
+      return -1;
+    }
+  }
+  else if ((sinkBuf = malloc(r->frame.outCap)) == NULL)
+  {
+    perror("malloc failed");
+    return -1;
+  }
+
+  printf("donut benchmark: %d frames per run, %dx%d cells, %s mode, %s engine, %d samples, %d threads, sink %s\n",
+         frames, r->frame.width, r->frame.height, renderModes[r->frame.mode].name, engineNames[r->engine],
+         r->torus->count, r->pool ? r->pool->count : 1, sink);
+  printf("%-8s %-7s %-10s %10s %10s %10s  (ns/frame)\n", "kernel", "encoder", "phase", "mean", "p50", "p99");
+  int status = 0, failed = 0;
+  for (int k = 0; k < RASTER_KERNEL_COUNT && status == 0; k++)
+  {
+    KernelInfo *kernel = &rasterKernels[k];
+    if (!listContains(kernels, kernel->name) && !(strcmp(kernels, "all") == 0 && kernel->supported) &&
+        !(strcmp(kernels, "auto") == 0 && kernel == findRasterKernel("auto")))
+    {
+      continue;
+    }
+    if (!kernel->supported)
+    {
+      fprintf(stderr, "Warning: Kernel '%s' is not supported by this CPU, skipping it.\n", kernel->name);
+      continue;
+    }
+    r->raster = kernel->fn;
+    r->ray = findRayKernel(kernel);
+    for (int delta = 0; delta < 2 && status == 0; delta++)
+    {
+      if (listContains(encoders, delta ? "delta" : "full") || strcmp(encoders, "all") == 0)
+      {
+        r->useDelta = delta;
+        status = benchmarkRun(r, kernel->name, frames, sinkFd, sinkBuf);
+      }
+    }
+    if (status == 0 && (kernel->fn != rasterScalar || r->engine == ENGINE_RAYCAST))
+    {
+      status = benchmarkAccuracy(r, kernel->name, rasterScalar, frames);
+      failed |= status == 1;
+      status = status == -1 ? -1 : 0;
+    }
+  }
+  if (sinkFd != -1)
+  {
+    close(sinkFd);
+  }
+  free(sinkBuf);
+  return status == -1 ? -1 : failed;
+}
+
+// Frame ring in shared memory (--shm) for other processes that want the
+// picture without parsing terminal output. The layout and a reader are in
+// donut_shm.h. Slots are sized for the largest frame up front; the file
+// lives on tmpfs, so only the pages actually written take memory.
+typedef struct
+{
+  DonutShmHeader *header; // Mapped file, or NULL
+  size_t size;
+  char path[256];         // shm_open() name
+  uint64_t published;     // Frames written
+} ShmRing;
+
+// Creates the ring NAME in /dev/shm, replacing a stale one (readers still
+// mapping that keep their copy). Returns -1 on failure.
+int shmRingOpen(ShmRing *s, const char *name)
+{
+  snprintf(s->path, sizeof(s->path), "/%s", name + (name[0] == '/'));
+  size_t cells = (size_t)DONUT_SHM_MAX_COLS * DONUT_SHM_MAX_ROWS;
+  size_t glyphOffset = ARENA_ALIGN(sizeof(DonutShmSlot)), lumOffset = glyphOffset + cells * sizeof(uint32_t);
+  size_t slotSize = (lumOffset + cells * DONUT_SHM_MAX_SUB + 4095) & ~(size_t)4095;
+  size_t headerSize = 4096; // Slots start on a page
+  s->size = headerSize + DONUT_SHM_SLOTS * slotSize;
+  s->published = 0;
+  shm_unlink(s->path);
+  int fd = shm_open(s->path, O_CREAT | O_EXCL | O_RDWR | O_CLOEXEC, 0644);
+  if (fd == -1)
+  {
+    return -1;
+  }
+  void *map = MAP_FAILED;
+  if (ftruncate(fd, (off_t)s->size) == 0)
+  {
+    map = mmap(NULL, s->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  }
+  close(fd);
+  if (map == MAP_FAILED)
+  {
+    shm_unlink(s->path);
+    return -1;
+  }
+  DonutShmHeader *h = map;
+  h->version = DONUT_SHM_VERSION;
+  h->slots = DONUT_SHM_SLOTS;
+  h->headerSize = headerSize;
+  h->slotSize = slotSize;
+  h->glyphOffset = glyphOffset;
+  h->lumOffset = lumOffset;
+  h->pid = (uint32_t)getpid();
+  atomic_thread_fence(memory_order_release); // Everything above before the magic
+  memcpy(h->magic, DONUT_SHM_MAGIC, 8);
+  s->header = h;
+  return 0;
+}
+
+// Publishes the rasterized frame: its glyphs and the luminance of its
+// raster grid, cropped to the slot size. Readers never hold up the writer;
+// they notice from the slot counter when a slot changed under them.
+void shmRingPublish(ShmRing *s, const Frame *f, const CellTable *t, long long timeNs)
+{
+  DonutShmHeader *h = s->header;
+  uint64_t n = s->published++;
+  char *base = (char *)h + h->headerSize + n % h->slots * h->slotSize;
+  DonutShmSlot *slot = (DonutShmSlot *)base;
+  atomic_store_explicit(&slot->seq, 2 * n + 1, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release); // Odd counter before any of the data
+
+  const RenderMode *m = &renderModes[f->mode];
+  int width = f->width < DONUT_SHM_MAX_COLS ? f->width : DONUT_SHM_MAX_COLS;
+  int height = f->height < DONUT_SHM_MAX_ROWS ? f->height : DONUT_SHM_MAX_ROWS;
+  slot->timeNs = timeNs;
+  slot->width = (uint32_t)width;
+  slot->height = (uint32_t)height;
+  slot->rasterWidth = (uint32_t)(width * m->subX);
+  slot->rasterHeight = (uint32_t)(height * m->subY);
+  slot->mode = (uint32_t)f->mode;
+  uint32_t *glyph = (uint32_t *)(base + h->glyphOffset);
+  for (int y = 0; y < height; y++)
+  {
+    const Cell *row = f->b + (size_t)f->width * y;
+    for (int x = 0; x < width; x++)
+    {
+      *glyph++ = t->codepoint[row[x]];
+    }
+  }
+  uint8_t *lum = (uint8_t *)(base + h->lumOffset);
+  for (int y = 0; y < height * m->subY; y++)
+  {
+    const uint32_t *point = f->depth + (size_t)f->view.width * y;
+    for (int x = 0; x < width * m->subX; x++)
+    {
+      *lum++ = point[x] ? (uint8_t)depthLuminance(point[x]) : DONUT_SHM_EMPTY;
+    }
+  }
+
+  atomic_store_explicit(&slot->seq, 2 * n + 2, memory_order_release);
+  atomic_store_explicit(&h->latest, n + 1, memory_order_release);
+}
+
+// Removes the ring; readers that still map it keep the last frames
+void shmRingClose(ShmRing *s)
+{
+  if (s->header != NULL)
+  {
+    munmap(s->header, s->size);
+    shm_unlink(s->path);
+    s->header = NULL;
+  }
+}
+
+// Recording (--record): every frame is appended to a large buffer by the
+// frame loop and a background thread writes the buffer out a chunk at a
+// time, so a slow disk never holds up a frame. If the writer falls behind,
+// the buffer grows instead; only past RECORD_MAX are frames dropped.
+// Two formats: asciicast v2 (the terminal output as JSON events) and a
+// compact binary one holding the framebuffer cells as deltas, which
+// --play turns back into terminal output.
+#define RECORD_CHUNK (1 << 20) // Filled bytes handed to the writer at once
+#define RECORD_MAX (64 << 20)  // Largest buffer while the writer is behind
+#define RECORD_MAGIC "DONUTR1"
+
+enum
+{
+  RECORD_ASCIICAST,
+  RECORD_BINARY
+};
+
+// Start of a binary recording: what is needed to turn cell codes into
+// terminal output
+typedef struct
+{
+  char magic[8];            // RECORD_MAGIC
+  uint32_t mode;            // MODE_*
+  uint32_t depth;           // DEPTH_*
+  unsigned char rgb[3][3];  // Palette
+  unsigned char ansi;
+  unsigned char palettes;   // Palettes in total, the others follow the header (0 in older files: 1)
+  unsigned char reserved[5];
+} RecordHeader;
+
+// Each further palette of a binary recording
+typedef struct
+{
+  unsigned char rgb[3][3];
+  unsigned char ansi;
+} RecordPalette;
+
+// Every frame of a binary recording, followed by size bytes of runs: the
+// number of unchanged cells to skip and the number of changed cells (both
+// LEB128), then that many 16-bit cell codes. A frame of a new size starts
+// from blank cells.
+typedef struct
+{
+  uint32_t size;          // Bytes of runs following
+  uint16_t width, height; // Framebuffer size in cells
+  int64_t timeNs;         // Since the start of the recording
+} RecordFrame;
+
+typedef struct
+{
+  int format;           // RECORD_*
+  int fd;
+  char *buf;            // Being filled by the frame loop
+  size_t len, cap;
+  char *spare;          // The other buffer, while the writer does not have it
+  size_t spareCap;
+  char *writing;        // Handed to the writer thread, NULL when it is idle
+  size_t writingLen;
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t wake, idle;
+  int stop;             // Set to end the writer thread
+  int failed;           // errno of a failed write, 0 if none
+  Cell *prev;           // Last recorded framebuffer (binary)
+  int width, height;    // Its size, 0 before the first frame
+  long long start;      // nowNs() the timestamps count from
+  unsigned long frames, dropped;
+  unsigned long long bytes; // Bytes written to the file
+} Recorder;
+
+void *recordThread(void *arg)
+{
+  Recorder *r = arg;
+  pthread_mutex_lock(&r->lock);
+  for (;;)
+  {
+    while (r->writing == NULL && !r->stop)
+    {
+      pthread_cond_wait(&r->wake, &r->lock);
+    }
+    if (r->writing == NULL)
+    {
+      break;
+    }
+    char *data = r->writing;
+    size_t len = r->writingLen;
+    pthread_mutex_unlock(&r->lock);
+    int failed = writeAll(r->fd, data, len) == -1 ? errno : 0;
+    pthread_mutex_lock(&r->lock);
+    r->failed = r->failed ? r->failed : failed;
+    r->bytes += failed ? 0 : len;
+    r->spare = data; // Back to the frame loop
+    r->writing = NULL;
+    pthread_cond_signal(&r->idle);
+  }
+  pthread_mutex_unlock(&r->lock);
+  return NULL;
+}
+
+// Hands the filled buffer to the writer if it is idle. Called with the
+// frame loop's buffer full or at least RECORD_CHUNK filled.
+static void recordHandOff(Recorder *r)
+{
+  pthread_mutex_lock(&r->lock);
+  if (r->writing == NULL && r->len > 0)
+  {
+    r->writing = r->buf;
+    r->writingLen = r->len;
+    char *spare = r->spare;
+    size_t spareCap = r->spareCap;
+    r->spareCap = r->cap;
+    r->buf = spare;
+    r->cap = spareCap;
+    r->len = 0;
+    pthread_cond_signal(&r->wake);
+  }
+  pthread_mutex_unlock(&r->lock);
+}
+
+// Room for need more bytes at buf + len, or NULL if the frame has to be
+// dropped. Never waits for the writer.
+static char *recordReserve(Recorder *r, size_t need)
+{
+  if (r->len >= RECORD_CHUNK || r->len + need > r->cap)
+  {
+    recordHandOff(r);
+  }
+  if (r->len + need > r->cap)
+  {
+    size_t cap = r->cap;
+    while (cap < r->len + need)
+    {
+      cap *= 2;
+    }
+    char *grown = cap <= RECORD_MAX ? realloc(r->buf, cap) : NULL;
+    if (grown == NULL)
+    {
+      r->dropped++;
+      return NULL;
+    }
+    r->buf = grown;
+    r->cap = cap;
+  }
+  return r->buf + r->len;
+}
+
+// Opens the recording, in the binary format unless path ends in ".cast",
+// and starts the writer thread. Returns -1 with errno set on failure, and
+// then removes the file again.
+int recordOpen(Recorder *r, const char *path, int cols, int rows, const Palette *palettes, int count, int depth,
+               int mode)
+{
+  size_t n = strlen(path);
+  r->format = n >= 5 && strcmp(path + n - 5, ".cast") == 0 ? RECORD_ASCIICAST : RECORD_BINARY;
+  r->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (r->fd == -1)
+  {
+    return -1;
+  }
+  r->cap = r->spareCap = 2 * RECORD_CHUNK;
+  r->buf = malloc(r->cap);
+  r->spare = malloc(r->spareCap);
+  if (r->buf == NULL || r->spare == NULL)
+  {
+    free(r->buf);
+    free(r->spare);
+    close(r->fd);
+    unlink(path);
+    errno = ENOMEM;
+    return -1;
+  }
+  if (r->format == RECORD_ASCIICAST)
+  {
+    r->len = (size_t)sprintf(r->buf, "{\"version\": 2, \"width\": %d, \"height\": %d, \"timestamp\": %lld, "
+                                     "\"title\": \"donut\"}\n", cols, rows, (long long)time(NULL));
+  }
+  else
+  {
+    RecordHeader h = {RECORD_MAGIC, (uint32_t)mode, (uint32_t)depth, {{0}}, (unsigned char)palettes[0].ansi,
+                      (unsigned char)count, {0}};
+    memcpy(h.rgb, palettes[0].rgb, sizeof(h.rgb));
+    memcpy(r->buf, &h, sizeof(h));
+    r->len = sizeof(h);
+    for (int p = 1; p < count; p++)
+    {
+      RecordPalette extra = {{{0}}, (unsigned char)palettes[p].ansi};
+      memcpy(extra.rgb, palettes[p].rgb, sizeof(extra.rgb));
+      memcpy(r->buf + r->len, &extra, sizeof(extra));
+      r->len += sizeof(extra);
+    }
+  }
+  r->start = nowNs();
+  pthread_mutex_init(&r->lock, NULL);
+  pthread_cond_init(&r->wake, NULL);
+  pthread_cond_init(&r->idle, NULL);
+  int err = pthread_create(&r->thread, NULL, recordThread, r);
+  if (err != 0)
+  {
+    pthread_cond_destroy(&r->idle);
+    pthread_cond_destroy(&r->wake);
+    pthread_mutex_destroy(&r->lock);
+    free(r->buf);
+    free(r->spare);
+    close(r->fd);
+    unlink(path);
+    errno = err;
+    return -1;
+  }
+  return 0;
+}
+
+// Appends an asciicast event of the given type with data as its JSON
+// string
+static void recordEvent(Recorder *r, char type, const char *data, size_t len, long long now)
+{
+  // Every byte escapes to at most 6 ("\u001b")
+  char *p = recordReserve(r, 6 * len + 64);
+  if (p == NULL)
+  {
+    return;
+  }
+  char *start = p;
+  p += sprintf(p, "[%.6f, \"%c\", \"", (now - r->start) * 1e-9, type);
+  for (size_t k = 0; k < len; k++)
+  {
+    unsigned char c = (unsigned char)data[k];
+    if (c == '"' || c == '\\')
+    {
+      *p++ = '\\';
+      *p++ = (char)c;
+    }
+    else if (c == '\n')
+    {
+      *p++ = '\\';
+      *p++ = 'n';
+    }
+    else if (c < 0x20)
+    {
+      p += sprintf(p, "\\u%04x", c);
+    }
+    else
+    {
+      *p++ = (char)c; // Printable ASCII and UTF-8 go in as they are
+    }
+  }
+  memcpy(p, "\"]\n", 3);
+  p += 3;
+  r->len += (size_t)(p - start);
+  r->frames += type == 'o';
+}
+
+// Records the encoded terminal output of a frame (asciicast)
+void recordOutput(Recorder *r, const char *data, size_t len, long long now)
+{
+  if (r->format == RECORD_ASCIICAST)
+  {
+    recordEvent(r, 'o', data, len, now);
+  }
+}
+
+// Records a terminal resize (asciicast)
+void recordResize(Recorder *r, int cols, int rows, long long now)
+{
+  if (r->format == RECORD_ASCIICAST)
+  {
+    char size[32];
+    recordEvent(r, 'r', size, (size_t)sprintf(size, "%dx%d", cols, rows), now);
+  }
+}
+
+static inline char *putVarint(char *p, unsigned v)
+{
+  while (v >= 0x80)
+  {
+    *p++ = (char)(v | 0x80);
+    v >>= 7;
+  }
+  *p++ = (char)v;
+  return p;
+}
+
+// Records the framebuffer as changes from the last recorded one (binary)
+void recordFrame(Recorder *r, const Frame *f, long long now)
+{
+  if (r->format != RECORD_BINARY)
+  {
+    return;
+  }
+  size_t cells = (size_t)f->width * f->height;
+  if (f->width != r->width || f->height != r->height)
+  {
+    Cell *prev = realloc(r->prev, cells * sizeof(Cell));
+    if (prev == NULL)
+    {
+      r->dropped++;
+      return;
+    }
+    r->prev = prev;
+    memset(prev, 0, cells * sizeof(Cell)); // A new size starts from blank
+    r->width = f->width;
+    r->height = f->height;
+  }
+  // At worst every other cell changes: 2 one-byte varints per code
+  char *p = recordReserve(r, sizeof(RecordFrame) + cells * 4 + 16);
+  if (p == NULL)
+  {
+    return;
+  }
+  char *runs = p + sizeof(RecordFrame), *q = runs;
+  size_t k = 0;
+  while (k < cells)
+  {
+    size_t skip = k;
+    while (k < cells && f->b[k] == r->prev[k])
+    {
+      k++;
+    }
+    if (k == cells)
+    {
+      break; // The rest is unchanged
+    }
+    size_t changed = k;
+    while (k < cells && f->b[k] != r->prev[k])
+    {
+      r->prev[k] = f->b[k];
+      k++;
+    }
+    q = putVarint(q, (unsigned)(changed - skip));
+    q = putVarint(q, (unsigned)(k - changed));
+    memcpy(q, f->b + changed, (k - changed) * sizeof(Cell));
+    q += (k - changed) * sizeof(Cell);
+  }
+  RecordFrame hdr = {(uint32_t)(q - runs), (uint16_t)f->width, (uint16_t)f->height, now - r->start};
+  memcpy(p, &hdr, sizeof(hdr));
+  r->len += (size_t)(q - p);
+  r->frames++;
+}
+
+// Writes what is left, stops the writer and closes the file. Returns -1
+// (with errno set) if anything could not be written.
+int recordClose(Recorder *r)
+{
+  pthread_mutex_lock(&r->lock);
+  while (r->writing != NULL)
+  {
+    pthread_cond_wait(&r->idle, &r->lock);
+  }
+  pthread_mutex_unlock(&r->lock);
+  recordHandOff(r);
+  pthread_mutex_lock(&r->lock);
+  r->stop = 1;
+  pthread_cond_signal(&r->wake);
+  pthread_mutex_unlock(&r->lock);
+  pthread_join(r->thread, NULL);
+  int failed = r->failed;
+  if (close(r->fd) == -1 && failed == 0)
+  {
+    failed = errno;
+  }
+  free(r->buf);
+  free(r->spare);
+  free(r->prev);
+  errno = failed;
+  return failed ? -1 : 0;
+}
+
+// Waits until frame time timeNs, reacting to keys and signals like the main
+// loop. A job-control stop moves *start on by its length, so playback
+// continues where it stopped. Returns 1 if playback should stop.
+static int playWait(struct pollfd *fds, long long *start, long long timeNs)
+{
+  int quit = 0, resized = 0;
+  long long remaining;
+  while (!quit && (remaining = *start + timeNs - nowNs()) > 0)
+  {
+    struct timespec timeout = {remaining / 1000000000LL, remaining % 1000000000LL};
+    if (ppoll(fds, 2, &timeout, NULL) == -1)
+    {
+      if (errno != EINTR)
+      {
+        return 1;
+      }
+      continue;
+    }
+    int stopped = 0, continued = 0;
+    if (fds[0].revents & POLLIN)
+    {
+      int events = handleInput(NULL, NULL);
+      quit |= events & INPUT_QUIT;
+      stopped = events & INPUT_SUSPEND;
+    }
+    else if (fds[0].revents & (POLLHUP | POLLERR))
+    {
+      quit = 1;
+    }
+    if (fds[1].revents & POLLIN)
+    {
+      quit |= handleSignals(fds[1].fd, &resized, &stopped, &continued);
+    }
+    if (stopped && !quit)
+    {
+      long long stopStart = nowNs();
+      suspendProcess(NULL);
+      resumeTerminal();
+      *start += nowNs() - stopStart;
+    }
+  }
+  return quit;
+}
+
+static inline const unsigned char *getVarint(const unsigned char *p, const unsigned char *end, unsigned *v)
+{
+  *v = 0;
+  for (int shift = 0; p < end && shift < 32; shift += 7)
+  {
+    *v |= (unsigned)(*p & 0x7F) << shift;
+    if ((*p++ & 0x80) == 0)
+    {
+      return p;
+    }
+  }
+  return NULL;
+}
+
+// Decodes the next asciicast output event at *p into out (which has room
+// for the line) and returns its length, or -1 at the end. Other events
+// are skipped with length 0.
+static long playCastEvent(const char **p, const char *end, long long *timeNs, char *out)
+{
+  const char *s = *p;
+  const char *eol = memchr(s, '\n', (size_t)(end - s));
+  eol = eol ? eol : end;
+  *p = eol < end ? eol + 1 : end;
+  if (s == end)
+  {
+    return -1;
+  }
+  // [seconds, "type", "data"]
+  double t = 0, scale = 1;
+  while (s < eol && (*s == '[' || *s == ' '))
+  {
+    s++;
+  }
+  for (; s < eol && ((*s >= '0' && *s <= '9') || *s == '.'); s++)
+  {
+    if (*s == '.')
+    {
+      scale = 0.1;
+    }
+    else if (scale == 1)
+    {
+      t = t * 10 + (*s - '0');
+    }
+    else
+    {
+      t += (*s - '0') * scale;
+      scale *= 0.1;
+    }
+  }
+  *timeNs = (long long)(t * 1e9);
+  const char *type = memchr(s, '"', (size_t)(eol - s));
+  if (type == NULL || type + 5 >= eol || type[1] != 'o')
+  {
+    return 0;
+  }
+  s = memchr(type + 3, '"', (size_t)(eol - type - 3));
+  if (s == NULL)
+  {
+    return 0;
+  }
+  char *o = out;
+  for (s++; s < eol && *s != '"'; s++)
+  {
+    if (*s != '\\' || s + 1 >= eol)
+    {
+      *o++ = *s;
+      continue;
+    }
+    char c = *++s;
+    if (c == 'u' && s + 4 < eol)
+    {
+      unsigned u = (unsigned)strtoul((char[]){s[1], s[2], s[3], s[4], 0}, NULL, 16);
+      s += 4;
+      if (u < 0x80)
+      {
+        *o++ = (char)u;
+      }
+      else if (u < 0x800)
+      {
+        *o++ = (char)(0xC0 | u >> 6);
+        *o++ = (char)(0x80 | (u & 0x3F));
+      }
+      else
+      {
+        *o++ = (char)(0xE0 | u >> 12);
+        *o++ = (char)(0x80 | (u >> 6 & 0x3F));
+        *o++ = (char)(0x80 | (u & 0x3F));
+      }
+    }
+    else
+    {
+      *o++ = c == 'n' ? '\n' : c == 'r' ? '\r' : c == 't' ? '\t' : c == 'b' ? '\b' : c == 'f' ? '\f' : c;
+    }
+  }
+  return o - out;
+}
+
+// Replays a recording from the mapped file at its original pace: an
+// asciicast's output as it is, a binary recording's cells through the
+// encoders. Returns -1 if the file cannot be played.
+int play(const char *path)
+{
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  struct stat st;
+  if (fd == -1 || fstat(fd, &st) == -1)
+  {
+    perror("open recording failed");
+    if (fd != -1)
+    {
+      close(fd);
+    }
+    return -1;
+  }
+  size_t size = (size_t)st.st_size;
+  const char *data = size > 0 ? mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+  close(fd);
+  int binary = data != MAP_FAILED && size >= sizeof(RecordHeader) && memcmp(data, RECORD_MAGIC, 8) == 0;
+  if (data == MAP_FAILED || (!binary && data[0] != '{'))
+  {
+    fprintf(stderr, "Error: '%s' is not a recording.\n", path);
+    if (data != MAP_FAILED)
+    {
+      munmap((void *)data, size);
+    }
+    return -1;
+  }
+  madvise((void *)data, size, MADV_SEQUENTIAL);
+  const char *end = data + size;
+
+  RecordHeader header;
+  CellTable *cells = malloc(sizeof(CellTable));
+  Cell *grid = NULL, *shown = NULL;
+  int width = -1, height = -1; // The first frame always starts from blank cells
+  int codes = 0;               // Cell codes of the header's mode and palettes
+  size_t outCap = 0;
+  char *out = NULL;
+  const char *p = data;
+  if (binary)
+  {
+    memcpy(&header, data, sizeof(header));
+    p += sizeof(header);
+    Palette palettes[MAX_PALETTES];
+    int count = header.palettes > 0 ? header.palettes : 1;
+    memcpy(palettes[0].rgb, header.rgb, sizeof(palettes[0].rgb));
+    palettes[0].ansi = header.ansi;
+    if (header.mode >= MODE_COUNT || header.depth >= DEPTH_COUNT || count > MAX_PALETTES ||
+        (size_t)(end - p) < sizeof(RecordPalette) * (count - 1) || cells == NULL)
+    {
+      fprintf(stderr, "Error: '%s' is not a recording.\n", path);
+      free(cells);
+      munmap((void *)data, size);
+      return -1;
+    }
+    for (int i = 1; i < count; i++)
+    {
+      RecordPalette extra;
+      memcpy(&extra, p, sizeof(extra));
+      memcpy(palettes[i].rgb, extra.rgb, sizeof(palettes[i].rgb));
+      palettes[i].ansi = extra.ansi;
+      p += sizeof(extra);
+    }
+    buildCellTable(palettes, count, (int)header.depth, (int)header.mode, cells);
+    codes = cellCodes((int)header.mode, cells->shades);
+  }
+  else
+  {
+    const char *eol = memchr(p, '\n', size); // Header line
+    p = eol ? eol + 1 : end;
+  }
+
+  int interactive = isatty(STDIN_FILENO);
+  if (interactive)
+  {
+    enableRawMode();
+  }
+  int sigFd = openSignalFd();
+  struct pollfd fds[2] = {{interactive ? STDIN_FILENO : -1, POLLIN, 0}, {sigFd, POLLIN, 0}};
+  long long start = nowNs();
+  int status = 0;
+  for (;;)
+  {
+    long long timeNs;
+    long len;
+    if (binary)
+    {
+      RecordFrame f;
+      if ((size_t)(end - p) < sizeof(f))
+      {
+        break;
+      }
+      memcpy(&f, p, sizeof(f));
+      const unsigned char *q = (const unsigned char *)p + sizeof(f), *runsEnd = q + f.size;
+      if (f.size > (size_t)(end - p) - sizeof(f))
+      {
+        break; // Cut off
+      }
+      if (f.width == 0 || f.height == 0)
+      {
+        break; // Damaged
+      }
+      p = (const char *)runsEnd;
+      timeNs = f.timeNs;
+      int key = f.width != width || f.height != height;
+      size_t count = (size_t)f.width * f.height;
+      if (key)
+      {
+        width = f.width;
+        height = f.height;
+        outCap = count * renderModes[header.mode].cellBytes + 128;
+        free(grid);
+        free(shown);
+        free(out);
+        grid = calloc(count, sizeof(Cell));
+        shown = calloc(count, sizeof(Cell));
+        out = malloc(outCap + 4);
+        if (grid == NULL || shown == NULL || out == NULL)
+        {
+          perror("malloc failed");
+          status = -1;
+          break;
+        }
+      }
+      size_t k = 0;
+      unsigned skip, changed;
+      while (q < runsEnd && (q = getVarint(q, runsEnd, &skip)) != NULL &&
+             (q = getVarint(q, runsEnd, &changed)) != NULL)
+      {
+        k += skip;
+        if (k + changed > count || (size_t)(runsEnd - q) < changed * sizeof(Cell))
+        {
+          break; // Damaged
+        }
+        int invalid = 0;
+        for (unsigned i = 0; i < changed; i++)
+        {
+          Cell c;
+          memcpy(&c, q + i * sizeof(Cell), sizeof(c)); // Runs are not aligned
+          invalid |= c >= codes;
+        }
+        if (invalid)
+        {
+          break; // Damaged: a code the cell table does not have
+        }
+        memcpy(grid + k, q, changed * sizeof(Cell));
+        k += changed;
+        q += changed * sizeof(Cell);
+      }
+      Rect all = {0, 0, width, height};
+      len = key ? 0 : (long)encodeDelta(grid, shown, width, cells, all, out, outCap - 64);
+      if (len == 0)
+      {
+        memcpy(out, "\x1b[2J", 4);
+        len = 4 + (long)encodeFrame(grid, width, height, cells, all, out + 4);
+      }
+      memcpy(shown, grid, count * sizeof(Cell));
+    }
+    else
+    {
+      const char *eol = memchr(p, '\n', (size_t)(end - p));
+      size_t line = (size_t)((eol ? eol : end) - p);
+      if (line > outCap)
+      {
+        // An event never decodes to more than its line
+        free(out);
+        outCap = 2 * line;
+        out = malloc(outCap);
+        if (out == NULL)
+        {
+          perror("malloc failed");
+          status = -1;
+          break;
+        }
+      }
+      if ((len = playCastEvent(&p, end, &timeNs, out)) < 0)
+      {
+        break;
+      }
+    }
+    if (playWait(fds, &start, timeNs))
+    {
+      break;
+    }
+    if (len > 0 && writeAll(STDOUT_FILENO, out, (size_t)len) == -1)
+    {
+      perror("write stdout failed");
+      status = -1;
+      break;
+    }
+  }
+  free(grid);
+  free(shown);
+  free(out);
+  free(cells);
+  munmap((void *)data, size);
+  close(sigFd);
+  return status;
+}
+
+// Broadcast server (--serve): one render loop for any number of TCP
+// clients, typically telnet. Clients with the same terminal size share a
+// variant, which rasterizes and encodes every frame once, as a full repaint
+// and as a delta from the frame before; the clients are then sent the same
+// reference-counted buffer, so the cost grows with the number of distinct
+// sizes rather than with the number of clients. A client that has not taken
+// its previous frame yet skips the new one and resynchronizes with a full
+// repaint, so one slow connection cannot hold up the others.
+#define SERVE_MAX_CLIENTS 256
+#define SERVE_MAX_VARIANTS 16
+#define SERVE_MAX_COLS 500
+#define SERVE_MAX_ROWS 200
+#define SERVE_SPARES 8               // Frame buffers kept for reuse
+#define SERVE_NOTSENT 16384          // Unsent bytes a socket may hold: about a frame, not seconds of them
+#define SERVE_NAWS_WAIT_NS 300000000LL // How long a new client may take to report its size
+
+// Telnet commands and options (RFC 854, 857, 858, 1073)
+enum
+{
+  TELNET_SE = 240,
+  TELNET_IP = 244,
+  TELNET_SB = 250,
+  TELNET_WILL = 251,
+  TELNET_WONT = 252,
+  TELNET_DO = 253,
+  TELNET_DONT = 254,
+  TELNET_IAC = 255,
+  TELNET_ECHO = 1,
+  TELNET_SGA = 3,
+  TELNET_NAWS = 31
+};
+
+// Encoded frame shared by the clients sending it
+typedef struct ServeBuf
+{
+  struct ServeBuf *next; // Next spare buffer
+  int refs;              // The variant and the clients still sending it
+  size_t cap, len;
+  char data[];
+} ServeBuf;
+
+// Frames for one terminal size
+typedef struct
+{
+  int cols, rows;
+  int clients;           // Clients watching, 0 if the slot is free
+  Renderer renderer;
+  TorusGeometry torus;
+  unsigned long seq;     // Frames rendered, the latest one has this number
+  ServeBuf *full;        // Latest frame as a full repaint, or NULL
+  ServeBuf *delta;       // Latest frame as changes from the one before, or NULL
+} ServeVariant;
+
+typedef struct
+{
+  int fd;                // Socket, -1 if the slot is free
+  int variant;           // Index of the variant shown, -1 while the size is unknown
+  int cols, rows;        // Reported terminal size
+  unsigned long shown;   // Frame of the variant the client shows, 0 if none
+  int clear;             // Clear the screen before the next full repaint
+  int closing;           // 1: quit requested, 2: goodbye queued
+  int polling;           // Waiting for the socket to become writable
+  ServeBuf *out;         // Frame being sent, or NULL
+  size_t outOff;
+  char pre[128];         // Telnet replies and escapes sent ahead of the frame
+  int preLen, preOff;
+  int telnet;            // Telnet parser state (0: data, else the command byte)
+  unsigned char sb[8];   // Subnegotiation being received
+  int sbLen;
+  long long connected;   // nowNs() at accept
+  unsigned long frames, skipped;
+  char name[64];         // Peer address
+} ServeClient;
+
+typedef struct
+{
+  const Renderer *proto; // Kernels, colors and workers of every variant
+  int mode;
+  float density;
+  int epoll;
+  ServeVariant variants[SERVE_MAX_VARIANTS];
+  ServeClient clients[SERVE_MAX_CLIENTS];
+  ServeBuf *spare;       // Buffers no longer in use
+  int spares;
+  unsigned long accepted, rendered, skipped;
+  unsigned long long sent;
+} Server;
+
+// A buffer for at least cap bytes, from the spares if one is large enough
+static ServeBuf *serveBufGet(Server *s, size_t cap)
+{
+  for (ServeBuf **p = &s->spare; *p != NULL; p = &(*p)->next)
+  {
+    if ((*p)->cap >= cap)
+    {
+      ServeBuf *b = *p;
+      *p = b->next;
+      s->spares--;
+      b->refs = 1;
+      return b;
+    }
+  }
+  ServeBuf *b = malloc(sizeof(ServeBuf) + cap);
+  if (b != NULL)
+  {
+    b->cap = cap;
+    b->refs = 1;
+  }
+  return b;
+}
+
+static void serveBufRelease(Server *s, ServeBuf *b)
+{
+  if (b == NULL || --b->refs > 0)
+  {
+    return;
+  }
+  if (s->spares < SERVE_SPARES)
+  {
+    b->next = s->spare;
+    s->spare = b;
+    s->spares++;
+  }
+  else
+  {
+    free(b);
+  }
+}
+
+// Queues bytes to go out before the next part of the frame. Telnet replies
+// may land in the middle of a frame: the client strips them from the data
+// stream, wherever they are.
+static void serveQueue(ServeClient *c, const void *data, int len)
+{
+  if (c->preOff == c->preLen)
+  {
+    c->preOff = c->preLen = 0;
+  }
+  if (c->preLen + len <= (int)sizeof(c->pre))
+  {
+    memcpy(c->pre + c->preLen, data, (size_t)len);
+    c->preLen += len;
+  }
+}
+
+static void serveWatch(Server *s, ServeClient *c, int writable)
+{
+  if (c->polling != writable)
+  {
+    struct epoll_event ev = {EPOLLIN | (writable ? EPOLLOUT : 0), {.u64 = (uint64_t)(c - s->clients) + 2}};
+    epoll_ctl(s->epoll, EPOLL_CTL_MOD, c->fd, &ev);
+    c->polling = writable;
+  }
+}
+
+// Sends as much of the pending output as the socket takes, with one writev
+// for the queued bytes and the frame. Returns -1 when the connection is
+// done: failed, or closed after the goodbye went out.
+static int serveFlush(Server *s, ServeClient *c)
+{
+  for (;;)
+  {
+    if (c->preOff == c->preLen && c->out == NULL)
+    {
+      if (c->closing != 1)
+      {
+        break;
+      }
+      // Leave the client's terminal as it was
+      static const char goodbye[] = "\x1b[0m\x1b[2J\x1b[H\x1b[?25h";
+      serveQueue(c, goodbye, sizeof(goodbye) - 1);
+      c->closing = 2;
+    }
+    struct iovec iov[2];
+    int count = 0;
+    if (c->preOff < c->preLen)
+    {
+      iov[count++] = (struct iovec){c->pre + c->preOff, (size_t)(c->preLen - c->preOff)};
+    }
+    if (c->out != NULL)
+    {
+      iov[count++] = (struct iovec){c->out->data + c->outOff, c->out->len - c->outOff};
+    }
+    ssize_t n = writev(c->fd, iov, count);
+    if (n == -1)
+    {
+      if (errno == EINTR)
+      {
+        continue;
+      }
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+      {
+        serveWatch(s, c, 1);
+        return 0;
+      }
+      return -1;
+    }
+    s->sent += (unsigned long long)n;
+    size_t pre = (size_t)(c->preLen - c->preOff) < (size_t)n ? (size_t)(c->preLen - c->preOff) : (size_t)n;
+    c->preOff += (int)pre;
+    if (c->out != NULL)
+    {
+      c->outOff += (size_t)n - pre;
+      if (c->outOff == c->out->len)
+      {
+        serveBufRelease(s, c->out);
+        c->out = NULL;
+        c->outOff = 0;
+      }
+    }
+  }
+  serveWatch(s, c, 0);
+  return c->closing == 2 ? -1 : 0;
+}
+
+static void serveLeave(Server *s, ServeClient *c)
+{
+  if (c->variant < 0)
+  {
+    return;
+  }
+  ServeVariant *v = &s->variants[c->variant];
+  c->variant = -1;
+  if (--v->clients == 0)
+  {
+    serveBufRelease(s, v->full);
+    serveBufRelease(s, v->delta);
+    free(v->renderer.frame.arena);
+    freeTorusGeometry(&v->torus);
+    memset(v, 0, sizeof(*v));
+  }
+}
+
+// Moves the client to the variant of its size, creating it if needed. When
+// every slot is taken or memory runs out, the client shares the largest
+// variant that fits its terminal (or the smallest one).
+static void serveJoin(Server *s, ServeClient *c)
+{
+  serveLeave(s, c);
+  int found = -1, unused = -1;
+  for (int i = 0; i < SERVE_MAX_VARIANTS; i++)
+  {
+    ServeVariant *v = &s->variants[i];
+    if (v->clients > 0 && v->cols == c->cols && v->rows == c->rows)
+    {
+      found = i;
+    }
+    else if (v->clients == 0 && unused == -1)
+    {
+      unused = i;
+    }
+  }
+  if (found == -1 && unused != -1)
+  {
+    ServeVariant *v = &s->variants[unused];
+    v->renderer = *s->proto;
+    v->renderer.frame = (Frame){0};
+    v->renderer.torus = &v->torus;
+    v->renderer.painted = RECT_EMPTY;
+    const ThreadPool *pool = s->proto->pool;
+    if (frameResize(&v->renderer.frame, c->cols, c->rows, pool ? pool->count - 1 : 0, s->mode) == 0 &&
+        buildTorusGeometry(&v->torus, fmaxf(v->renderer.frame.view.sx, v->renderer.frame.view.sy),
+                           s->density) == 0)
+    {
+      rendererInvalidate(&v->renderer);
+      v->cols = c->cols;
+      v->rows = c->rows;
+      found = unused;
+    }
+    else
+    {
+      free(v->renderer.frame.arena);
+      memset(v, 0, sizeof(*v));
+    }
+  }
+  if (found == -1)
+  {
+    long best = 0;
+    for (int i = 0; i < SERVE_MAX_VARIANTS; i++)
+    {
+      ServeVariant *v = &s->variants[i];
+      long area = (long)v->cols * v->rows;
+      int fits = v->cols <= c->cols && v->rows <= c->rows;
+      // Fitting variants rank above all others, larger ones first; of the
+      // rest the smallest wins
+      long score = fits ? area + (1L << 30) : (1L << 30) - area;
+      if (v->clients > 0 && score > best)
+      {
+        best = score;
+        found = i;
+      }
+    }
+  }
+  if (found >= 0)
+  {
+    s->variants[found].clients++;
+  }
+  c->variant = found;
+  c->shown = 0;
+  c->clear = 1; // The old picture has a different layout
+}
+
+static void serveClose(Server *s, ServeClient *c)
+{
+  fprintf(stderr, "Client %s disconnected after %lu frames (%lu skipped)\n", c->name, c->frames, c->skipped);
+  serveLeave(s, c);
+  serveBufRelease(s, c->out);
+  close(c->fd); // Also removes it from the epoll set
+  c->fd = -1;
+}
+
+// Handles one byte from the client: telnet commands, the window size and
+// the quit keys
+static void serveInput(Server *s, ServeClient *c, unsigned char ch)
+{
+  unsigned char reply[3] = {TELNET_IAC, 0, ch};
+  switch (c->telnet)
+  {
+  case 0:
+    if (ch == TELNET_IAC)
+    {
+      c->telnet = TELNET_IAC;
+    }
+    else if (ch == 'q' || ch == 'Q' || ch == 27 || ch == 3 || ch == 4) // ESC, Ctrl-C, Ctrl-D
+    {
+      c->closing |= 1;
+    }
+    break;
+  case TELNET_IAC:
+    c->telnet = ch >= TELNET_WILL && ch <= TELNET_DONT ? ch : ch == TELNET_SB ? TELNET_SB : 0;
+    c->sbLen = 0;
+    if (ch == TELNET_IP)
+    {
+      c->closing |= 1;
+    }
+    break;
+  case TELNET_WILL:
+  case TELNET_DO:
+    // Refuse everything that was not offered: the server asks for NAWS and
+    // offers ECHO and SGA, which puts the client in character mode
+    if (c->telnet == TELNET_WILL ? ch != TELNET_NAWS : ch != TELNET_ECHO && ch != TELNET_SGA)
+    {
+      reply[1] = c->telnet == TELNET_WILL ? TELNET_DONT : TELNET_WONT;
+      serveQueue(c, reply, 3);
+    }
+    c->telnet = 0;
+    break;
+  case TELNET_WONT:
+  case TELNET_DONT:
+    c->telnet = 0;
+    break;
+  case TELNET_SB:
+    if (ch == TELNET_IAC)
+    {
+      c->telnet = TELNET_SE; // IAC inside a subnegotiation: SE or an escaped 255
+    }
+    else if (c->sbLen < (int)sizeof(c->sb))
+    {
+      c->sb[c->sbLen++] = ch;
+    }
+    break;
+  case TELNET_SE:
+    c->telnet = ch == TELNET_IAC ? TELNET_SB : 0;
+    if (ch == TELNET_IAC && c->sbLen < (int)sizeof(c->sb))
+    {
+      c->sb[c->sbLen++] = ch;
+    }
+    else if (ch == TELNET_SE && c->sbLen >= 5 && c->sb[0] == TELNET_NAWS)
+    {
+      int cols = c->sb[1] << 8 | c->sb[2], rows = c->sb[3] << 8 | c->sb[4];
+      cols = cols == 0 ? 80 : cols < 8 ? 8 : cols > SERVE_MAX_COLS ? SERVE_MAX_COLS : cols;
+      rows = rows == 0 ? 24 : rows < 6 ? 6 : rows > SERVE_MAX_ROWS ? SERVE_MAX_ROWS : rows;
+      if (c->variant == -1 || cols != c->cols || rows != c->rows)
+      {
+        c->cols = cols;
+        c->rows = rows;
+        serveJoin(s, c);
+      }
+    }
+    break;
+  }
+}
+
+// Reads everything the client sent. Returns -1 if it hung up.
+static int serveRead(Server *s, ServeClient *c)
+{
+  unsigned char buf[256];
+  ssize_t n;
+  while ((n = read(c->fd, buf, sizeof(buf))) > 0)
+  {
+    for (ssize_t k = 0; k < n; k++)
+    {
+      serveInput(s, c, buf[k]);
+    }
+  }
+  if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+  {
+    return -1;
+  }
+  return 0;
+}
+
+static void serveAccept(Server *s, int listenFd)
+{
+  struct sockaddr_storage addr;
+  socklen_t addrLen = sizeof(addr);
+  int fd;
+  while ((fd = accept4(listenFd, (struct sockaddr *)&addr, &addrLen, SOCK_NONBLOCK | SOCK_CLOEXEC)) != -1)
+  {
+    ServeClient *c = NULL;
+    for (int i = 0; i < SERVE_MAX_CLIENTS && c == NULL; i++)
+    {
+      c = s->clients[i].fd == -1 ? &s->clients[i] : NULL;
+    }
+    struct epoll_event ev = {EPOLLIN, {.u64 = c ? (uint64_t)(c - s->clients) + 2 : 0}};
+    if (c == NULL || epoll_ctl(s->epoll, EPOLL_CTL_ADD, fd, &ev) == -1)
+    {
+      close(fd); // Full
+      addrLen = sizeof(addr);
+      continue;
+    }
+    memset(c, 0, sizeof(*c));
+    c->fd = fd;
+    c->variant = -1;
+    c->cols = 80;
+    c->rows = 24;
+    c->connected = nowNs();
+    if (getnameinfo((struct sockaddr *)&addr, addrLen, c->name, sizeof(c->name), NULL, 0, NI_NUMERICHOST) != 0)
+    {
+      strcpy(c->name, "?");
+    }
+    // Frames go out as soon as they are encoded, and little may wait in the
+    // kernel unsent, so a slow client falls behind (and skips) early. Unlike
+    // a small send buffer this does not limit the data in flight.
+    int one = 1, notsent = SERVE_NOTSENT;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    setsockopt(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &notsent, sizeof(notsent));
+    static const unsigned char hello[] = {TELNET_IAC, TELNET_WILL, TELNET_ECHO, TELNET_IAC, TELNET_WILL, TELNET_SGA,
+                                          TELNET_IAC, TELNET_DO, TELNET_NAWS};
+    serveQueue(c, hello, sizeof(hello));
+    serveQueue(c, "\x1b[?25l", 6); // Hide cursor
+    s->accepted++;
+    fprintf(stderr, "Client %s connected\n", c->name);
+    if (serveFlush(s, c) == -1)
+    {
+      serveClose(s, c);
+    }
+    addrLen = sizeof(addr);
+  }
+}
+
+// Renders the next frame of every variant that has a client ready for it
+// and hands it out: the delta to clients showing the frame before, the full
+// repaint to all others. Clients still sending an earlier frame skip this
+// one.
+static void serveFrame(Server *s, double A, double B)
+{
+  long long now = nowNs();
+  for (int i = 0; i < SERVE_MAX_CLIENTS; i++)
+  {
+    ServeClient *c = &s->clients[i];
+    if (c->fd != -1 && c->variant == -1 && now - c->connected > SERVE_NAWS_WAIT_NS)
+    {
+      serveJoin(s, c); // No size reported (not telnet), keep 80x24
+    }
+  }
+  for (int vi = 0; vi < SERVE_MAX_VARIANTS; vi++)
+  {
+    ServeVariant *v = &s->variants[vi];
+    Renderer *r = &v->renderer;
+    Frame *f = &r->frame;
+    if (v->clients == 0)
+    {
+      continue;
+    }
+    int wantFull = 0, wantDelta = 0;
+    for (int i = 0; i < SERVE_MAX_CLIENTS; i++)
+    {
+      ServeClient *c = &s->clients[i];
+      if (c->fd != -1 && c->variant == vi && c->out == NULL && !c->closing)
+      {
+        int follows = r->useDelta && c->shown != 0 && c->shown == v->seq;
+        wantDelta |= follows;
+        wantFull |= !follows;
+      }
+    }
+    if (!wantFull && !wantDelta)
+    {
+      for (int i = 0; i < SERVE_MAX_CLIENTS; i++)
+      {
+        ServeClient *c = &s->clients[i];
+        if (c->fd != -1 && c->variant == vi && !c->closing)
+        {
+          c->skipped++; // Everyone is busy, nothing worth rendering
+          s->skipped++;
+        }
+      }
+      continue;
+    }
+
+    rendererClear(r);
+    rendererRasterize(r, A, B);
+    serveBufRelease(s, v->full);
+    serveBufRelease(s, v->delta);
+    v->full = v->delta = NULL;
+    if (wantDelta && (v->delta = serveBufGet(s, f->outCap)) != NULL)
+    {
+      size_t limit = r->fullBytes < f->outCap - 64 ? r->fullBytes : f->outCap - 64;
+      v->delta->len = encodeDelta(f->b, f->prev, f->width, r->cells, rectUnion(f->bBox, f->prevBox),
+                                  v->delta->data, limit);
+      if (v->delta->len == 0)
+      {
+        serveBufRelease(s, v->delta); // Larger than a full repaint
+        v->delta = NULL;
+      }
+      r->deltaFrames += v->delta != NULL;
+    }
+    if ((wantFull || v->delta == NULL) && (v->full = serveBufGet(s, f->outCap)) != NULL)
+    {
+      // Every client of the variant cleared its screen when it joined, so
+      // the area drawn since then covers anything it may show
+      v->full->len = encodeFrame(f->b, f->width, f->height, r->cells, rectUnion(r->painted, f->bBox),
+                                 v->full->data);
+      r->fullBytes = v->full->len;
+    }
+    r->painted = rectUnion(r->painted, f->bBox);
+    rendererPresented(r);
+    v->seq++;
+    s->rendered++;
+
+    for (int i = 0; i < SERVE_MAX_CLIENTS; i++)
+    {
+      ServeClient *c = &s->clients[i];
+      if (c->fd == -1 || c->variant != vi || c->closing)
+      {
+        continue;
+      }
+      if (c->out != NULL)
+      {
+        c->skipped++; // Still busy with an earlier frame
+        s->skipped++;
+        continue;
+      }
+      ServeBuf *b = c->shown + 1 == v->seq && v->delta != NULL ? v->delta : v->full;
+      if (b == NULL)
+      {
+        continue; // Out of memory, try again next frame
+      }
+      if (b == v->full && c->clear)
+      {
+        serveQueue(c, "\x1b[2J", 4);
+        c->clear = 0;
+      }
+      b->refs++;
+      c->out = b;
+      c->outOff = 0;
+      c->shown = v->seq;
+      c->frames++;
+      if (serveFlush(s, c) == -1)
+      {
+        serveClose(s, c);
+      }
+    }
+  }
+}
+
+// Opens a listening TCP socket on the port, for IPv6 and IPv4 if possible.
+// Returns -1 on failure.
+static int serveListen(int port)
+{
+  int one = 1, zero = 0;
+  int fd = socket(AF_INET6, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd != -1)
+  {
+    struct sockaddr_in6 addr = {0};
+    addr.sin6_family = AF_INET6;
+    addr.sin6_port = htons((uint16_t)port);
+    addr.sin6_addr = in6addr_any;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &zero, sizeof(zero));
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0 && listen(fd, 64) == 0)
+    {
+      return fd;
+    }
+    close(fd);
+  }
+  fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd == -1)
+  {
+    return -1;
+  }
+  struct sockaddr_in addr = {0};
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons((uint16_t)port);
+  addr.sin_addr.s_addr = htonl(INADDR_ANY);
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 || listen(fd, 64) == -1)
+  {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+// Runs the broadcast server until SIGINT or SIGTERM. proto provides the
+// kernels, cell table (with crlf set), workers and encoder choice for all
+// variants. Returns -1 if the server could not start.
+int serve(const Renderer *proto, int mode, float density, int port, double fps, float speedFactor, int showStats)
+{
+  Server *s = calloc(1, sizeof(Server));
+  int listenFd = serveListen(port);
+  int sigFd = openSignalFd();
+  if (s == NULL || listenFd == -1 || sigFd == -1 || (s->epoll = epoll_create1(EPOLL_CLOEXEC)) == -1)
+  {
+    perror("server setup failed");
+    free(s);
+    return -1;
+  }
+  signal(SIGPIPE, SIG_IGN); // Failed writes to hung up clients return EPIPE instead
+  s->proto = proto;
+  s->mode = mode;
+  s->density = density;
+  for (int i = 0; i < SERVE_MAX_CLIENTS; i++)
+  {
+    s->clients[i].fd = -1;
+  }
+  struct epoll_event ev = {EPOLLIN, {.u64 = 0}};
+  epoll_ctl(s->epoll, EPOLL_CTL_ADD, listenFd, &ev);
+  ev.data.u64 = 1;
+  epoll_ctl(s->epoll, EPOLL_CTL_ADD, sigFd, &ev);
+  fprintf(stderr, "Serving on port %d (%s mode), connect with: telnet HOST %d\n", port,
+          renderModes[mode].name, port);
+
+  FrameScheduler sched;
+  schedulerInit(&sched, fps);
+  long long startTime = nowNs();
+  int quit = 0;
+  while (!quit)
+  {
+    // All variants show the same angles, so a wall of screens stays in step
+    double elapsed = (nowNs() - startTime) * 1e-9 * speedFactor;
+    serveFrame(s, elapsed * SPIN_RATE_A, elapsed * SPIN_RATE_B);
+
+    long long remaining = schedulerRemaining(&sched);
+    do
+    {
+      struct epoll_event events[64];
+      int timeout = remaining > 0 ? (int)((remaining + 999999) / 1000000) : 0;
+      int n = epoll_wait(s->epoll, events, 64, timeout);
+      if (n == -1 && errno != EINTR)
+      {
+        perror("epoll_wait failed");
+        quit = 1;
+      }
+      for (int k = 0; k < n; k++)
+      {
+        uint64_t id = events[k].data.u64;
+        if (id == 0)
+        {
+          serveAccept(s, listenFd);
+          continue;
+        }
+        if (id == 1)
+        {
+          int resized = 0, stopped = 0, continued = 0;
+          quit |= handleSignals(sigFd, &resized, &stopped, &continued);
+          if (stopped)
+          {
+            suspendProcess(NULL);
+          }
+          continue;
+        }
+        ServeClient *c = &s->clients[id - 2];
+        if (c->fd == -1)
+        {
+          continue; // Closed by an earlier event of this batch
+        }
+        int failed = (events[k].events & EPOLLIN) && serveRead(s, c) == -1;
+        // Input may have queued telnet replies or a quit
+        int flush = (events[k].events & (EPOLLOUT | EPOLLERR)) || c->closing == 1 || c->preOff < c->preLen;
+        if (failed || (flush && serveFlush(s, c) == -1))
+        {
+          serveClose(s, c);
+        }
+      }
+    } while (!quit && (remaining = schedulerRemaining(&sched)) > 0);
+    schedulerAdvance(&sched);
+  }
+
+  for (int i = 0; i < SERVE_MAX_CLIENTS; i++)
+  {
+    ServeClient *c = &s->clients[i];
+    if (c->fd != -1)
+    {
+      // Best effort goodbye, without waiting for slow clients
+      serveBufRelease(s, c->out);
+      c->out = NULL;
+      c->closing = 1;
+      serveFlush(s, c);
+      serveClose(s, c);
+    }
+  }
+  if (showStats)
+  {
+    fprintf(stderr, "Served: %lu clients, %lu variant frames rendered, %lu client frames skipped, %.1f MB sent\n",
+            s->accepted, s->rendered, s->skipped, s->sent / 1e6);
+    fprintf(stderr, "Deadlines missed: %lu, frames skipped: %lu\n", sched.missed, sched.skipped);
+  }
+  while (s->spare != NULL)
+  {
+    ServeBuf *b = s->spare;
+    s->spare = b->next;
+    free(b);
+  }
+  close(s->epoll);
+  close(listenFd);
+  close(sigFd);
+  free(s);
+  return 0;
+}
+
+// Statistics of the animation loop: the phase histograms, plus the totals
+// at the last overlay update, so the overlay shows the rates since then
+typedef struct
+{
+  Histogram phase[LOOP_PHASES];
+  int overlay;             // Show the overlay on the top line ('s')
+  int overlayShown;        // The top line holds an overlay
+  long long overlayNext;   // When the overlay is redrawn next
+  long long lastTime;      // Totals at the last redraw
+  unsigned long lastFrames;
+  unsigned long long lastBytes, lastSamples, lastPasses;
+  unsigned long lastN[LOOP_PHASES];
+  unsigned long long lastTotal[LOOP_PHASES];
+} LoopStats;
+
+#define OVERLAY_BYTES 512              // Room for the overlay after a frame
+#define OVERLAY_PERIOD_NS 500000000LL // How often its numbers change
+
+// Appends the overlay to out when it is due or redraw is set (the screen
+// was cleared), or its removal after it was switched off. The top line has
+// the statistics, the bottom line the settings and their keys; the frame
+// leaves both free. Returns the number of bytes appended, at most
+// OVERLAY_BYTES.
+size_t statsOverlay(LoopStats *s, const Renderer *r, const Settings *settings, unsigned long frames,
+                    unsigned long long bytes, unsigned long missed, int redraw, char *out)
+{
+  long long now = nowNs();
+  int bottom = r->frame.height + 2; // Terminal line of the settings
+  if (!s->overlay)
+  {
+    if (!s->overlayShown || redraw)
+    {
+      s->overlayShown = 0;
+      return 0;
+    }
+    s->overlayShown = 0;
+    return (size_t)sprintf(out, "\x1b[1;1H\x1b[K\x1b[%d;1H\x1b[K", bottom); // Erase the lines
+  }
+  if (s->overlayShown && !redraw && now < s->overlayNext)
+  {
+    return 0;
+  }
+  double mean[LOOP_PHASES];
+  for (int p = 0; p < LOOP_PHASES; p++)
+  {
+    unsigned long n = atomic_load_explicit(&s->phase[p].n, memory_order_relaxed);
+    unsigned long long total = atomic_load_explicit(&s->phase[p].total, memory_order_relaxed);
+    mean[p] = n > s->lastN[p] ? (double)(total - s->lastTotal[p]) / (n - s->lastN[p]) / 1000 : 0;
+    s->lastN[p] = n;
+    s->lastTotal[p] = total;
+  }
+  if (now > s->lastTime && frames > s->lastFrames)
+  {
+    unsigned long count = frames - s->lastFrames;
+    unsigned long long samples = r->samples - s->lastSamples;
+    char text[2][OVERLAY_BYTES / 2 - 24];
+    int n[2];
+    n[0] = snprintf(text[0], sizeof(text[0]),
+                    "%.1f fps  raster %.0f  clear %.0f  encode %.0f  flush %.0f  input %.0f us  "
+                    "%.1f KB/frame  z %.0f%%  missed %lu",
+                    count * 1e9 / (now - s->lastTime), mean[LOOP_RASTER], mean[LOOP_CLEAR], mean[LOOP_ENCODE],
+                    mean[LOOP_FLUSH], mean[LOOP_INPUT], (bytes - s->lastBytes) / 1024.0 / count,
+                    samples ? 100.0 * (r->passes - s->lastPasses) / samples : 0, missed);
+    n[1] = snprintf(text[1], sizeof(text[1]), "+- %g fps  <> density %g  c %s colors  e %s  tT %d threads  d %s",
+                    settings->fps, settings->density, settings->depth == -1 ? "auto" : depthNames[settings->depth],
+                    engineNames[settings->engine], settings->threads, settings->delta ? "delta" : "full");
+    s->lastTime = now;
+    s->lastFrames = frames;
+    s->lastBytes = bytes;
+    s->lastSamples = r->samples;
+    s->lastPasses = r->passes;
+    s->overlayNext = now + OVERLAY_PERIOD_NS;
+    s->overlayShown = 1;
+    char *p = out;
+    for (int line = 0; line < 2; line++)
+    {
+      int len = n[line] < (int)sizeof(text[line]) ? n[line] : (int)sizeof(text[line]) - 1;
+      len = len < r->frame.width - 1 ? len : r->frame.width - 1; // Never wrap
+      p += sprintf(p, "\x1b[%d;1H\x1b[0m", line == 0 ? 1 : bottom);
+      memcpy(p, text[line], (size_t)len);
+      p += len;
+      memcpy(p, "\x1b[K", 3);
+      p += 3;
+    }
+    return (size_t)(p - out);
+  }
+  return 0;
+}
+
+// Prints the phase timings (for --stats)
+void statsPrint(FILE *out, const LoopStats *s)
+{
+  fprintf(out, "Phases (us)     mean      p50      p90      p99      max\n");
+  for (int p = 0; p < LOOP_PHASES; p++)
+  {
+    const Histogram *h = &s->phase[p];
+    fprintf(out, "  %-8s %9.1f %8.1f %8.1f %8.1f %8.1f\n", loopPhaseNames[p], histMean(h) / 1000,
+            histPercentile(h, 0.5) / 1000.0, histPercentile(h, 0.9) / 1000.0, histPercentile(h, 0.99) / 1000.0,
+            atomic_load_explicit(&h->max, memory_order_relaxed) / 1000.0);
+  }
+}
+
+// Writes all statistics as JSON (for --stats-json). Returns -1 on failure.
+int statsWriteJson(const char *path, const LoopStats *s, const Renderer *r, FrameRing *ring,
+                   const FrameScheduler *sched, unsigned long frames, unsigned long long bytes)
+{
+  FILE *f = fopen(path, "w");
+  if (f == NULL)
+  {
+    return -1;
+  }
+  fprintf(f, "{\n  \"frames\": %lu,\n  \"delta_frames\": %lu,\n  \"bytes_encoded\": %llu,\n", frames,
+          r->deltaFrames, bytes);
+  fprintf(f, "  \"bytes_written\": %llu,\n  \"samples\": %llu,\n  \"depth_passes\": %llu,\n",
+          (unsigned long long)atomic_load(&ring->written), r->samples, r->passes);
+  fprintf(f, "  \"depth_pass_rate\": %.4f,\n", r->samples ? (double)r->passes / r->samples : 0);
+  fprintf(f, "  \"deadlines_missed\": %lu,\n  \"frames_skipped\": %lu,\n  \"frames_dropped\": %lu,\n",
+          sched->missed, sched->skipped, ring->dropped);
+  fprintf(f, "  \"frames_superseded\": %lu,\n  \"phases\": {\n", (unsigned long)atomic_load(&ring->superseded));
+  for (int p = 0; p < LOOP_PHASES; p++)
+  {
+    const Histogram *h = &s->phase[p];
+    fprintf(f, "    \"%s\": {\"count\": %lu, \"mean_ns\": %.0f, \"p50_ns\": %lld, \"p90_ns\": %lld, "
+               "\"p99_ns\": %lld, \"max_ns\": %lld,\n      \"buckets\": [",
+            loopPhaseNames[p], (unsigned long)atomic_load(&h->n), histMean(h), histPercentile(h, 0.5),
+            histPercentile(h, 0.9), histPercentile(h, 0.99), (long long)atomic_load(&h->max));
+    // Only the buckets in use, as [smallest value in ns, count]
+    const char *sep = "";
+    for (int b = 0; b < HIST_BUCKETS; b++)
+    {
+      unsigned long count = atomic_load_explicit(&h->count[b], memory_order_relaxed);
+      if (count > 0)
+      {
+        fprintf(f, "%s[%lld, %lu]", sep, histLower(b), count);
+        sep = ", ";
+      }
+    }
+    fprintf(f, "]}%s\n", p + 1 < LOOP_PHASES ? "," : "");
+  }
+  fprintf(f, "  }\n}\n");
+  return fclose(f) == 0 ? 0 : -1;
+}
+
+// Returns the value of the option at argv[*a] and moves past it; exits if
+// the value is missing
+const char *optionValue(int argc, char *argv[], int *a)
+{
+  if (*a + 1 >= argc)
+  {
+    fprintf(stderr, "Error: Option '%s' requires a value.\n", argv[*a]);
+    exit(1);
+  }
+  return argv[++*a];
+}
+
+// Prints the command line help
+void printUsage(const char *prog)
+{
+  printf("Usage: %s [options] [color] [speed]\n", prog);
+  printf("Press 'q' or ESC to quit, 's' to show statistics and settings. While it runs,\n");
+  printf("+/- change the frame rate, </> the density, 'c' the color depth, 'e' the\n");
+  printf("engine, 't'/'T' the number of threads and 'd' switches delta encoding.\n\n");
+  printf("Arguments:\n");
+  printf("  color          Color name (optional, default: green).\n");
+  printf("                 Available: green, red, blue, cyan, magenta, yellow, white\n"); // English names
+  printf("  speed          Positive rotation speed factor (optional, default: 1.0).\n");
+  printf("                 > 1.0: faster, < 1.0: slower. Does not change the frame rate.\n\n");
+  printf("Options:\n");
+  printf("  --bench N      Render N frames without a terminal as fast as possible and print\n");
+  printf("                 per-phase timings. --kernel and --encoder take comma-separated\n");
+  printf("                 lists (or 'all') to compare them.\n");
+  printf("  --bench-sink S Where benchmark output goes: null (/dev/null, default) or memory.\n");
+  printf("  --budget B     Output limit in bytes per second (k and M suffixes allowed). The\n");
+  printf("                 frame rate (and with --color-depth auto the colors) drops to fit.\n");
+  printf("  --cache N      Render one turn of N frames once and replay it (0: as many as\n");
+  printf("                 --fps gives; otherwise the frame rate follows from N).\n");
+  printf("  --cache-file F Keep the cached turn in file F and reuse it when the size and\n");
+  printf("                 colors match. Implies --cache 0.\n");
+  printf("  --color-depth D  Color escapes: truecolor (default), 256, 16 or auto, which\n");
+  printf("                 steps down when the terminal or --budget cannot keep up.\n");
+  printf("  --density D    Sampling density: samples at most 1/D cells apart, so 1 (default)\n");
+  printf("                 leaves no holes; 0 uses the classic fixed steps.\n");
+  printf("  --encoder E    Frame encoder: delta (default, only changed cells) or full.\n");
+  printf("  --engine E     Rasterizer engine: points (default, projects torus samples) or\n");
+  printf("                 raycast (one ray per cell, uses avx2 with --kernel avx2/avx512).\n");
+  printf("  --fps N        Target frame rate, up to %d (default: 30).\n", MAX_FPS);
+  printf("  --kernel NAME  Rasterizer kernel (default: auto, the fastest this CPU supports).\n");
+  printf("                 Available: ");
+  printRasterKernels(stdout);
+  printf("\n");
+  printf("  --light X,Y,Z  Light towards direction X,Y,Z (x right, y down, z into the\n");
+  printf("                 screen; default 0,-1,-1). Repeat for up to %d lights.\n", MAX_LIGHTS);
+  printf("  --mode M       Output: cells (default, one character of the luminance ramp per\n");
+  printf("                 cell), half (2 points per cell with half blocks) or braille (2x4\n");
+  printf("                 dots per cell); the last two shade with colors instead.\n");
+  printf("  --no-delta     Same as --encoder full.\n");
+  printf("  --no-idle      Keep the full frame rate while the terminal has no focus, output\n");
+  printf("                 backs up or goes to a file (default: drop to %d fps).\n", IDLE_FPS);
+  printf("  --play FILE    Replay a recording made with --record, without rendering.\n");
+  printf("  --record FILE  Record the frames to FILE: asciicast v2 if it ends in .cast,\n");
+  printf("                 otherwise a compact binary format of framebuffer changes.\n");
+  printf("  --serve PORT   Broadcast to telnet clients on TCP port PORT instead of drawing\n");
+  printf("                 here; the frames are rendered once per client terminal size.\n");
+  printf("  --shm NAME     Also publish every frame (glyphs and luminance) in the shared\n");
+  printf("                 memory ring /dev/shm/NAME, read with donut_shm.h.\n");
+  printf("  --size WxH     Terminal size for --bench (default: current terminal or 80x24).\n");
+  printf("  --threads N    Rasterizer threads (default: 1, 0: one per CPU).\n");
+  printf("  --torus X,Y,SIZE[,COLOR[,SPEED]]\n");
+  printf("                 Draw a torus centered at X,Y (-1..1 spans the screen, up to 2\n");
+  printf("                 places it off screen), scaled by SIZE (up to 1) and turning SPEED\n");
+  printf("                 times as fast. COLOR defaults to the color argument and SPEED\n");
+  printf("                 to 1. Repeat for up to %d tori.\n", MAX_INSTANCES);
+  printf("  --stats        Print frame, output and phase timing statistics to stderr on\n");
+  printf("                 exit. Press 's' for a live overlay of them on the top line.\n");
+  printf("  --stats-json F Write the statistics, with the phase histograms, as JSON to F on\n");
+  printf("                 exit.\n");
+}
+
+int main(int argc, char *argv[])
+{
+  // Default values
+  const char *colorName = "gruen"; // Default color
+  float speedFactor = 1.0f;
+  double fps = 30; // Target frame rate (--fps)
+
+  int showStats = 0;  // Print statistics on exit (--stats)
+  int positional = 0; // Number of positional arguments seen so far
+  const char *kernelName = "auto";   // Rasterizer kernel (--kernel)
+  const char *encoderName = "delta"; // Frame encoder (--encoder)
+  int benchFrames = 0;               // Benchmark instead of animating (--bench)
+  const char *benchSink = "null";    // Benchmark output sink (--bench-sink)
+  int benchCols = 0, benchRows = 0;  // Benchmark terminal size (--size)
+  int threads = 1;                   // Rasterizer threads (--threads)
+  int colorDepth = DEPTH_TRUECOLOR;  // DEPTH_* or -1 for auto (--color-depth)
+  long long budget = 0;              // Output bytes per second, 0: unlimited (--budget)
+  int cacheFrames = -1;              // Replay a cached turn of N frames, 0: from --fps (--cache)
+  const char *cachePath = NULL;      // File keeping the cached turn (--cache-file)
+  float density = 1;                 // Sampling density, 0: classic steps (--density)
+  int engine = ENGINE_POINTS;        // ENGINE_* (--engine)
+  int mode = MODE_CELLS;             // MODE_* (--mode)
+  int servePort = 0;                 // Broadcast to TCP clients instead of the terminal (--serve)
+  const char *shmName = NULL;        // Publish frames in /dev/shm (--shm)
+  const char *recordPath = NULL;     // Record the frames to a file (--record)
+  const char *playPath = NULL;       // Replay a recording instead of rendering (--play)
+  Lighting lights = {1, {{0, -1, -1}}, 0}; // Replaced by the --light options
+  int lightOptions = 0;
+  const char *statsJson = NULL;      // Write the statistics as JSON on exit (--stats-json)
+  int idleThrottle = 1;              // Slow down while nobody watches (--no-idle turns it off)
+  Scene scene = {0};                 // Tori placed by --torus, one classic torus without
+  char torusColors[MAX_INSTANCES][16] = {{0}}; // Their color names, empty for the positional color
+
+  detectRasterKernels();
+
+  // Process arguments
+  for (int a = 1; a < argc; a++)
+  {
+    // Show help?
+    if (strcmp(argv[a], "-h") == 0 || strcmp(argv[a], "--help") == 0)
+    {
+      printUsage(argv[0]);
+      return 0;
+    }
+    else if (strcmp(argv[a], "--stats") == 0)
+    {
+      showStats = 1;
+    }
+    else if (strcmp(argv[a], "--stats-json") == 0)
+    {
+      statsJson = optionValue(argc, argv, &a);
+    }
+    else if (strcmp(argv[a], "--kernel") == 0)
+    {
+      kernelName = optionValue(argc, argv, &a);
+    }
+    else if (strcmp(argv[a], "--encoder") == 0)
+    {
+      encoderName = optionValue(argc, argv, &a);
+    }
+    else if (strcmp(argv[a], "--bench") == 0)
+    {
+      const char *value = optionValue(argc, argv, &a);
+      benchFrames = atoi(value);
+      if (benchFrames <= 0)
+      {
+        fprintf(stderr, "Error: Invalid frame count '%s'.\n", value);
+        return 1;
+      }
+    }
+    else if (strcmp(argv[a], "--bench-sink") == 0)
+    {
+      benchSink = optionValue(argc, argv, &a);
+      if (strcmp(benchSink, "null") != 0 && strcmp(benchSink, "memory") != 0)
+      {
+        fprintf(stderr, "Error: Invalid benchmark sink '%s'. Use null or memory.\n", benchSink);
+        return 1;
+      }
+    }
+    else if (strcmp(argv[a], "--record") == 0)
+    {
+      recordPath = optionValue(argc, argv, &a);
+    }
+    else if (strcmp(argv[a], "--play") == 0)
+    {
+      playPath = optionValue(argc, argv, &a);
+    }
+    else if (strcmp(argv[a], "--shm") == 0)
+    {
+      shmName = optionValue(argc, argv, &a);
+      if (shmName[shmName[0] == '/'] == '\0' || strchr(shmName + 1, '/') != NULL)
+      {
+        fprintf(stderr, "Error: Invalid shared memory name '%s'. Use a name without slashes.\n", shmName);
+        return 1;
+      }
+    }
+    else if (strcmp(argv[a], "--size") == 0)
+    {
+      const char *value = optionValue(argc, argv, &a);
+      if (sscanf(value, "%dx%d", &benchCols, &benchRows) != 2 || benchCols < 8 || benchRows < 6 ||
+          benchCols > MAX_COLS || benchRows > MAX_ROWS)
+      {
+        fprintf(stderr, "Error: Invalid size '%s'. Use COLSxROWS, from 8x6 up to %dx%d.\n", value, MAX_COLS,
+                MAX_ROWS);
+        return 1;
+      }
+    }
+    else if (strcmp(argv[a], "--threads") == 0)
+    {
+      const char *value = optionValue(argc, argv, &a);
+      char *endptr;
+      threads = (int)strtol(value, &endptr, 10);
+      if (*endptr != '\0' || threads < 0 || threads > MAX_THREADS)
+      {
+        fprintf(stderr, "Error: Invalid thread count '%s'. Use 0 to %d.\n", value, MAX_THREADS);
+        return 1;
+      }
+      if (threads == 0)
+      {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = cpus < 1 ? 1 : cpus > MAX_THREADS ? MAX_THREADS : (int)cpus;
+      }
+    }
+    else if (strcmp(argv[a], "--fps") == 0)
+    {
+      const char *value = optionValue(argc, argv, &a);
+      char *endptr;
+      fps = strtod(value, &endptr);
+      if (*endptr != '\0' || !(fps > 0 && fps <= MAX_FPS)) // Also rejects NaN
+      {
+        fprintf(stderr, "Warning: Invalid frame rate '%s'. Must be a positive number up to %d. Using default 30.\n",
+                value, MAX_FPS);
+        fps = 30;
+      }
+    }
+    else if (strcmp(argv[a], "--color-depth") == 0)
+    {
+      const char *value = optionValue(argc, argv, &a);
+      colorDepth = strcmp(value, "auto") == 0 ? -1 : DEPTH_COUNT;
+      for (int d = 0; d < DEPTH_COUNT; d++)
+      {
+        if (strcmp(value, depthNames[d]) == 0)
+        {
+          colorDepth = d;
+        }
+      }
+      if (colorDepth == DEPTH_COUNT)
+      {
+        fprintf(stderr, "Error: Invalid color depth '%s'. Use truecolor, 256, 16 or auto.\n", value);
+        return 1;
+      }
+    }
+    else if (strcmp(argv[a], "--budget") == 0)
+    {
+      const char *value = optionValue(argc, argv, &a);
+      char *endptr;
+      double bytes = strtod(value, &endptr);
+      bytes *= *endptr == 'k' || *endptr == 'K' ? 1e3 : *endptr == 'M' ? 1e6 : 1;
+      endptr += *endptr == 'k' || *endptr == 'K' || *endptr == 'M';
+      if (*endptr != '\0' || bytes < 1)
+      {
+        fprintf(stderr, "Error: Invalid budget '%s'. Use bytes per second, e.g. 50000 or 50k.\n", value);
+        return 1;
+      }
+      budget = (long long)bytes;
+    }
+    else if (strcmp(argv[a], "--cache") == 0)
+    {
+      const char *value = optionValue(argc, argv, &a);
+      char *endptr;
+      cacheFrames = (int)strtol(value, &endptr, 10);
+      if (*endptr != '\0' || cacheFrames < 0 || cacheFrames == 1)
+      {
+        fprintf(stderr, "Error: Invalid cache frame count '%s'. Use 0 or at least 2.\n", value);
+        return 1;
+      }
+    }
+    else if (strcmp(argv[a], "--cache-file") == 0)
+    {
+      cachePath = optionValue(argc, argv, &a);
+    }
+    else if (strcmp(argv[a], "--density") == 0)
+    {
+      const char *value = optionValue(argc, argv, &a);
+      char *endptr;
+      density = strtof(value, &endptr);
+      if (*endptr != '\0' || density < 0 || density > 8)
+      {
+        fprintf(stderr, "Error: Invalid density '%s'. Use 0 (classic steps) or up to 8.\n", value);
+        return 1;
+      }
+    }
+    else if (strcmp(argv[a], "--engine") == 0)
+    {
+      const char *value = optionValue(argc, argv, &a);
+      engine = ENGINE_COUNT;
+      for (int e = 0; e < ENGINE_COUNT; e++)
+      {
+        if (strcmp(value, engineNames[e]) == 0)
+        {
+          engine = e;
+        }
+      }
+      if (engine == ENGINE_COUNT)
+      {
+        fprintf(stderr, "Error: Invalid engine '%s'. Use points or raycast.\n", value);
+        return 1;
+      }
+    }
+    else if (strcmp(argv[a], "--mode") == 0)
+    {
+      const char *value = optionValue(argc, argv, &a);
+      mode = MODE_COUNT;
+      for (int m = 0; m < MODE_COUNT; m++)
+      {
+        if (strcmp(value, renderModes[m].name) == 0)
+        {
+          mode = m;
+        }
+      }
+      if (mode == MODE_COUNT)
+      {
+        fprintf(stderr, "Error: Invalid mode '%s'. Use cells, half or braille.\n", value);
+        return 1;
+      }
+    }
+    else if (strcmp(argv[a], "--light") == 0)
+    {
+      const char *value = optionValue(argc, argv, &a);
+      float x, y, z;
+      char extra;
+      if (sscanf(value, "%f,%f,%f%c", &x, &y, &z, &extra) != 3 || !(x * x + y * y + z * z > 0) ||
+          !isfinite(x * x + y * y + z * z))
+      {
+        fprintf(stderr, "Error: Invalid light '%s'. Use X,Y,Z, a nonzero direction.\n", value);
+        return 1;
+      }
+      if (lightOptions == MAX_LIGHTS)
+      {
+        fprintf(stderr, "Error: At most %d lights are supported.\n", MAX_LIGHTS);
+        return 1;
+      }
+      float scale = sqrtf(2 / (x * x + y * y + z * z));
+      lights.dir[lightOptions][0] = x * scale, lights.dir[lightOptions][1] = y * scale,
+      lights.dir[lightOptions][2] = z * scale;
+      lights.count = ++lightOptions;
+    }
+    else if (strcmp(argv[a], "--torus") == 0)
+    {
+      const char *value = optionValue(argc, argv, &a);
+      if (scene.count == MAX_INSTANCES)
+      {
+        fprintf(stderr, "Error: At most %d tori are supported.\n", MAX_INSTANCES);
+        return 1;
+      }
+      // X,Y,SIZE, then optionally COLOR and SPEED
+      Instance *in = &scene.instance[scene.count];
+      char *color = torusColors[scene.count], extra;
+      in->speed = 1;
+      int commas = 0;
+      for (const char *c = value; *c; c++)
+      {
+        commas += *c == ',';
+      }
+      int fields = commas == 2 ? sscanf(value, "%f,%f,%f%c", &in->x, &in->y, &in->size, &extra)
+                               : sscanf(value, "%f,%f,%f,%15[^,],%f%c", &in->x, &in->y, &in->size, color, &in->speed,
+                                        &extra);
+      if (commas < 2 || commas > 4 || fields != commas + 1 || !(fabsf(in->x) <= 2) || !(fabsf(in->y) <= 2) ||
+          !(in->size > 0 && in->size <= 1) || !isfinite(in->speed))
+      {
+        fprintf(stderr, "Error: Invalid torus '%s'. Use X,Y,SIZE[,COLOR[,SPEED]] with X and Y from -2 to 2 "
+                        "and SIZE above 0 up to 1.\n", value);
+        return 1;
+      }
+      scene.count++;
+    }
+    else if (strcmp(argv[a], "--serve") == 0)
+    {
+      const char *value = optionValue(argc, argv, &a);
+      char *endptr;
+      servePort = (int)strtol(value, &endptr, 10);
+      if (*endptr != '\0' || servePort < 1 || servePort > 65535)
+      {
+        fprintf(stderr, "Error: Invalid port '%s'. Use 1 to 65535.\n", value);
+        return 1;
+      }
+    }
+    else if (strcmp(argv[a], "--no-delta") == 0)
+    {
+      encoderName = "full";
+    }
+    else if (strcmp(argv[a], "--no-idle") == 0)
+    {
+      idleThrottle = 0;
+    }
+    else if (strncmp(argv[a], "--", 2) == 0)
+    {
+      fprintf(stderr, "Warning: Unknown option '%s'. Use '%s --help' for help.\n", argv[a], argv[0]);
+    }
+    else if (positional == 0)
+    {
+      colorName = argv[a];
+      positional++;
+    }
+    else if (positional == 1)
+    {
+      char *endptr;
+      speedFactor = strtof(argv[a], &endptr);
+      // Check if conversion was successful and the value is positive
+      if (*endptr != '\0' || speedFactor <= 0)
+      {
+        fprintf(stderr, "Warning: Invalid speed factor '%s'. Must be a positive number. Using default 1.0.\n", argv[a]);
+        speedFactor = 1.0f;
+      }
+      positional++;
+    }
+    else if (positional == 2)
+    {
+      fprintf(stderr, "Warning: Too many arguments. Use '%s --help' for help.\n", argv[0]);
+      positional++;
+      // Optional: Exit with error here or simply ignore
+      // return 1;
+    }
+  }
+
+  if (servePort > 0 && (cacheFrames >= 0 || cachePath != NULL || budget > 0))
+  {
+    fprintf(stderr, "Error: --serve cannot be combined with --cache, --cache-file or --budget.\n");
+    return 1;
+  }
+  if (shmName != NULL && (cacheFrames >= 0 || cachePath != NULL || servePort > 0))
+  {
+    fprintf(stderr, "Error: --shm cannot be combined with --cache, --cache-file or --serve.\n");
+    return 1;
+  }
+  if (recordPath != NULL && (servePort > 0 || benchFrames > 0))
+  {
+    fprintf(stderr, "Error: --record cannot be combined with --serve or --bench.\n");
+    return 1;
+  }
+  size_t recordLen = recordPath ? strlen(recordPath) : 0;
+  if (recordLen > 0 && (recordLen < 5 || strcmp(recordPath + recordLen - 5, ".cast") != 0) &&
+      (cacheFrames >= 0 || cachePath != NULL))
+  {
+    fprintf(stderr, "Error: Binary recordings need rendered frames; record to a .cast file with --cache.\n");
+    return 1;
+  }
+  if (playPath != NULL)
+  {
+    return play(playPath) == -1 ? 1 : 0;
+  }
+  if (cachePath != NULL && cacheFrames < 0)
+  {
+    cacheFrames = 0; // A cache file implies --cache
+  }
+  if (cacheFrames > 0)
+  {
+    // That many frames per turn; the frame rate keeps the speed unchanged
+    fps = cacheFrames * SPIN_RATE_B * speedFactor / (2 * M_PI);
+    if (fps > MAX_FPS)
+    {
+      fprintf(stderr, "Error: --cache %d needs %.0f fps at this speed, at most %d are supported.\n", cacheFrames,
+              fps, MAX_FPS);
+      return 1;
+    }
+  }
+
+  // The classic torus unless --torus placed others. Set the color palettes
+  // based on the names (accepts German/English names); instances of the
+  // same color share one.
+  if (scene.count == 0)
+  {
+    scene.instance[0] = (Instance){0, 0, 1, 1, 0};
+    scene.count = 1;
+  }
+  for (int i = 0; i < scene.count; i++)
+  {
+    Palette palette;
+    setColorPalette(torusColors[i][0] ? torusColors[i] : colorName, &palette);
+    int p = 0;
+    while (p < scene.palettes && (memcmp(scene.palette[p].rgb, palette.rgb, sizeof(palette.rgb)) != 0 ||
+                                  scene.palette[p].ansi != palette.ansi))
+    {
+      p++;
+    }
+    if (p == scene.palettes)
+    {
+      scene.palette[scene.palettes++] = palette;
+    }
+    scene.instance[i].palette = p;
+    if (cacheFrames >= 0 && scene.instance[i].speed != roundf(scene.instance[i].speed))
+    {
+      fprintf(stderr, "Error: --cache needs whole-number torus speeds, so that one turn repeats.\n");
+      return 1;
+    }
+  }
+  CellTable cellTable; // Pre-rendered output for every cell value
+  buildCellTable(scene.palette, scene.palettes, colorDepth == -1 ? DEPTH_TRUECOLOR : colorDepth, mode, &cellTable);
+
+  // Framebuffers sized for the terminal, resized on SIGWINCH
+  Renderer renderer = {0};
+  renderer.cells = &cellTable;
+  renderer.scene = &scene;
+  renderer.engine = engine;
+  int cols, rows;
+  terminalSize(&cols, &rows);
+  if (benchFrames > 0 && benchCols > 0)
+  {
+    cols = benchCols;
+    rows = benchRows;
+  }
+  if (frameResize(&renderer.frame, cols, rows, threads - 1, mode) == -1)
+  {
+    perror("malloc failed");
+    return 1;
+  }
+
+  // Sample the torus for this size and raster grid, every frame only
+  // rotates and projects the points
+  TorusGeometry torus;
+  if (buildTorusGeometry(&torus, fmaxf(renderer.frame.view.sx, renderer.frame.view.sy), density) == -1)
+  {
+    perror("malloc failed");
+    return 1;
+  }
+
+  renderer.torus = &torus;
+  renderer.lights = &lights;
+
+  // Worker threads stay alive for the whole run and are woken per frame
+  ThreadPool pool;
+  if (poolStart(&pool, threads) == -1)
+  {
+    perror("pthread_create failed");
+    return 1;
+  }
+  renderer.pool = &pool;
+
+  if (benchFrames > 0)
+  {
+    int status = benchmark(&renderer, kernelName, encoderName, benchFrames, benchSink);
+    poolStop(&pool);
+    free(renderer.frame.arena);
+    freeTorusGeometry(&torus);
+    return status != 0 ? 1 : 0;
+  }
+
+  KernelInfo *kernel = findRasterKernel(kernelName);
+  if (kernel == NULL || !kernel->supported)
+  {
+    fprintf(stderr, "Error: %s kernel '%s'. Available: ", kernel ? "Unsupported" : "Unknown", kernelName);
+    printRasterKernels(stderr);
+    fprintf(stderr, "\n");
+    return 1;
+  }
+  renderer.raster = kernel->fn;
+  renderer.ray = findRayKernel(kernel);
+  if (strcmp(encoderName, "delta") != 0 && strcmp(encoderName, "full") != 0)
+  {
+    fprintf(stderr, "Error: Unknown encoder '%s'. Available: delta, full\n", encoderName);
+    return 1;
+  }
+  renderer.useDelta = strcmp(encoderName, "delta") == 0;
+  rendererInvalidate(&renderer);
+
+  if (servePort > 0)
+  {
+    cellTable.crlf = 1; // Sockets have no tty output processing
+    int status = serve(&renderer, mode, density, servePort, fps, speedFactor, showStats);
+    poolStop(&pool);
+    free(renderer.frame.arena);
+    freeTorusGeometry(&torus);
+    return status == -1 ? 1 : 0;
+  }
+
+  // Frames for other processes, next to the terminal output
+  ShmRing shm = {0};
+  if (shmName != NULL && benchFrames == 0 && shmRingOpen(&shm, shmName) == -1)
+  {
+    fprintf(stderr, "Error: Could not create shared memory '%s': %s\n", shmName, strerror(errno));
+    return 1;
+  }
+
+  // Terminal setup for non-blocking input. Without a terminal on stdin
+  // (recording from a script, say) only signals end the run. Started in
+  // the background, raw mode waits until the job is brought to the front.
+  int interactive = isatty(STDIN_FILENO);
+  if (interactive && inForeground())
+  {
+    enableRawMode();
+  }
+  else if (interactive)
+  {
+    rawSuspended = 1;
+  }
+
+  unsigned long frames = 0;          // Frames written
+  unsigned long long totalBytes = 0; // Bytes written over all frames
+  size_t frameBytes = 0;             // Bytes of the most recent frame
+  long long rasterNs = 0;            // Time spent in the rasterizer
+  renderer.clearScreen = 1;          // Cursor is hidden in enableRawMode
+  fflush(stdout); // Frames bypass stdio, so flush before the first one
+
+  // Frames are paced to absolute deadlines, while the angles follow the
+  // elapsed time, so a faster spin does not cost more frames
+  FrameScheduler sched;
+  schedulerInit(&sched, fps);
+  long long startTime = nowNs();
+
+  // Keyboard input and signals are both waited for with ppoll()
+  int sigFd = openSignalFd();
+  if (sigFd == -1)
+  {
+    perror("signalfd failed");
+    return 1;
+  }
+  struct pollfd fds[2] = {{interactive ? STDIN_FILENO : -1, POLLIN, 0}, {sigFd, POLLIN, 0}};
+  int resized = 0;
+
+  // With --cache the frames come from a pre-rendered turn, built on the
+  // first frame and again after changes of size, colors or frame rate
+  FrameCache cache = {0};
+  int cacheIndex = 0;  // Frame of the turn to show next
+  int cacheShown = -1; // Frame of the turn the terminal shows, -1 if none
+
+  // Encoded frames are written by a separate thread, without blocking, so
+  // a stalled terminal cannot hold up the loop or quitting
+  int stdoutFlags = fcntl(STDOUT_FILENO, F_GETFL);
+  fcntl(STDOUT_FILENO, F_SETFL, stdoutFlags | O_NONBLOCK);
+  FrameRing ring;
+  if (ringStart(&ring, STDOUT_FILENO, renderer.frame.outCap) == -1)
+  {
+    fcntl(STDOUT_FILENO, F_SETFL, stdoutFlags);
+    perror("writer thread setup failed");
+    return 1;
+  }
+
+  // Frames are recorded as they are encoded, written out by another thread
+  Recorder record = {0};
+  if (recordPath != NULL && recordOpen(&record, recordPath, cols, rows, scene.palette, scene.palettes,
+                                       colorDepth == -1 ? DEPTH_TRUECOLOR : colorDepth, mode) == -1)
+  {
+    ringStop(&ring);
+    fcntl(STDOUT_FILENO, F_SETFL, stdoutFlags);
+    fprintf(stderr, "Error: Could not record to '%s': %s\n", recordPath, strerror(errno));
+    return 1;
+  }
+
+  // Phase timings, collected all the time since they cost next to nothing
+  LoopStats stats = {0};
+  stats.lastTime = nowNs();
+  ring.flush = &stats.phase[LOOP_FLUSH];
+
+  // Color depth and frame rate follow the budget and the terminal's pace
+  int adaptive = colorDepth == -1 || budget > 0;
+  QualityController quality;
+  controllerInit(&quality, colorDepth, fps, budget);
+
+  // Nobody watches a terminal without focus, a stuck one or a file (or
+  // /dev/null), so those get IDLE_FPS; recorded or published frames are
+  // watched elsewhere, at any focus
+  IdleMonitor idle;
+  int watchedElsewhere = recordPath != NULL || shm.header != NULL;
+  idleInit(&idle, !idleThrottle      ? 0
+                  : watchedElsewhere ? IDLE_BACKLOG
+                                     : IDLE_UNFOCUSED | IDLE_BACKLOG | IDLE_REDIRECTED);
+  struct stat output;
+  idleSet(&idle, IDLE_REDIRECTED,
+          fstat(STDOUT_FILENO, &output) == 0 &&
+              (S_ISREG(output.st_mode) || (S_ISCHR(output.st_mode) && !isatty(STDOUT_FILENO))));
+  idleSet(&idle, IDLE_BACKGROUND, interactive && !inForeground());
+  if (idle.reasons)
+  {
+    idleApply(&idle, &sched, &quality);
+  }
+
+  // What the keys change, applied at the start of the next frame
+  Settings settings = {fps, density, colorDepth, engine, threads, renderer.useDelta, 0};
+  int rebuild = 0; // Buffers and samples need rebuilding, as after a resize
+
+  int quit = 0;
+  while (!quit) // Main loop, until quit != 0
+  {
+    if (settings.changed)
+    {
+      int changed = settings.changed;
+      settings.changed = 0;
+      if (changed & SETTING_THREADS)
+      {
+        // Private depth tiles come with the thread count
+        poolStop(&pool);
+        if (poolStart(&pool, settings.threads) == -1)
+        {
+          // A single worker needs no thread, so this cannot fail
+          fprintf(stderr, "Warning: Could not start %d threads (%s), rendering with one\n", settings.threads,
+                  strerror(errno));
+          poolStart(&pool, 1);
+          settings.threads = 1;
+        }
+        rebuild = 1;
+      }
+      if (changed & SETTING_DENSITY)
+      {
+        density = settings.density;
+        rebuild = 1;
+      }
+      engine = renderer.engine = settings.engine;
+      renderer.useDelta = settings.delta;
+      if (changed & (SETTING_FPS | SETTING_DEPTH))
+      {
+        // The controller starts over, from the best step at the new rate
+        fps = settings.fps;
+        colorDepth = settings.depth;
+        adaptive = colorDepth == -1 || budget > 0;
+        controllerInit(&quality, colorDepth, fps, budget);
+        buildCellTable(scene.palette, scene.palettes, quality.steps[0].depth, mode, &cellTable);
+        idleApply(&idle, &sched, &quality);
+      }
+      rendererInvalidate(&renderer);
+      cacheRelease(&cache); // Made with the old settings
+      stats.overlayNext = 0; // Show the new settings at once
+    }
+
+    if (resized || rebuild)
+    {
+      // Follow the new terminal size (or density or thread count); the old
+      // picture is garbled after a resize, so repaint from scratch
+      terminalSize(&cols, &rows);
+      freeTorusGeometry(&torus);
+      if (frameResize(&renderer.frame, cols, rows, pool.count - 1, mode) == -1 ||
+          buildTorusGeometry(&torus, fmaxf(renderer.frame.view.sx, renderer.frame.view.sy), density) == -1)
+      {
+        perror("malloc failed");
+        break;
+      }
+      rendererInvalidate(&renderer);
+      renderer.clearScreen = 1;
+      cacheRelease(&cache); // Made for the old size
+      if (recordPath != NULL && resized)
+      {
+        recordResize(&record, cols, rows, nowNs());
+      }
+      resized = 0;
+      rebuild = 0;
+    }
+
+    int failed = atomic_load(&ring.failed);
+    if (failed != 0)
+    {
+      fprintf(stderr, "write stdout failed: %s\n", strerror(failed));
+      break;
+    }
+
+    // With every slot still queued the terminal is behind; skip this frame
+    // instead of piling up stale ones. Nothing is rendered, so the delta
+    // reference stays what the terminal will show.
+    RingSlot *slot = ringAcquire(&ring, renderer.frame.outCap + OVERLAY_BYTES);
+    if (idle.reasons & IDLE_BACKGROUND)
+    {
+      // Another job owns the terminal until the wait below sees it is ours
+    }
+    else if (slot == NULL)
+    {
+      ring.dropped++;
+    }
+    else if (cacheFrames >= 0)
+    {
+      if (cache.frames == 0)
+      {
+        // (Re)build the cycle for the current size, colors and frame rate
+        int count = cycleFrames(quality.steps[quality.current].fps, speedFactor);
+        uint64_t key = cacheKey(&renderer, count);
+        if (cachePath == NULL || cacheLoad(&cache, cachePath, key, count) == -1)
+        {
+          if (cacheBuild(&cache, &renderer, count) == -1)
+          {
+            perror("malloc failed");
+            break;
+          }
+          if (cachePath != NULL && cacheSave(&cache, cachePath, key) == -1)
+          {
+            fprintf(stderr, "Warning: Could not write cache file '%s': %s\n", cachePath, strerror(errno));
+          }
+        }
+        // Continue from the current angle of the turn
+        cacheIndex = cacheFrameAt(&cache, (nowNs() - startTime) * 1e-9 * speedFactor);
+        cacheShown = -1;
+      }
+
+      // Replay the next frame, as a delta if the terminal shows the one
+      // before it and nothing waits behind the frame being written
+      int follows = cacheShown == (cacheIndex + cache.frames - 1) % cache.frames && !renderer.clearScreen &&
+                    ringPending(&ring) < 2 && renderer.useDelta;
+      long long encodeStart = nowNs();
+      size_t clear = 0;
+      if (renderer.clearScreen)
+      {
+        memcpy(slot->buf, "\x1b[2J", 4);
+        clear = 4;
+        renderer.clearScreen = 0;
+      }
+      frameBytes = clear + cacheCopy(&cache, cacheIndex, follows, slot->buf + clear);
+      histAdd(&stats.phase[LOOP_ENCODE], nowNs() - encodeStart);
+      if (recordPath != NULL)
+      {
+        recordOutput(&record, slot->buf, frameBytes, nowNs());
+      }
+      frameBytes += statsOverlay(&stats, &renderer, &settings, frames, totalBytes, sched.missed, clear > 0,
+                                 slot->buf + frameBytes);
+      ringPublish(&ring, frameBytes, !follows, clear > 0);
+      cacheShown = cacheIndex;
+      renderer.deltaFrames += follows;
+      frames++;
+      totalBytes += frameBytes;
+    }
+    else
+    {
+      long long clearStart = nowNs();
+      rendererClear(&renderer);
+      histAdd(&stats.phase[LOOP_CLEAR], nowNs() - clearStart);
+
+      // Rotation angles for this frame from the elapsed time
+      double elapsed = (nowNs() - startTime) * 1e-9 * speedFactor;
+
+      // Donut calculation (rotation and projection)
+      long long rasterStart = nowNs();
+      rendererRasterize(&renderer, elapsed * SPIN_RATE_A, elapsed * SPIN_RATE_B);
+      long long rasterNsFrame = nowNs() - rasterStart;
+      rasterNs += rasterNsFrame;
+      histAdd(&stats.phase[LOOP_RASTER], rasterNsFrame);
+      if (shm.header != NULL)
+      {
+        shmRingPublish(&shm, &renderer.frame, &cellTable, rasterStart);
+      }
+      if (recordPath != NULL)
+      {
+        recordFrame(&record, &renderer.frame, rasterStart);
+      }
+
+      // Encode the frame straight into the slot and queue it for the writer.
+      // If frames already wait behind the one being written, repaint fully
+      // so the writer can skip them.
+      if (ringPending(&ring) >= 2)
+      {
+        rendererInvalidate(&renderer);
+      }
+      unsigned long deltaFrames = renderer.deltaFrames;
+      int cleared = renderer.clearScreen;
+      long long encodeStart = nowNs();
+      frameBytes = rendererEncode(&renderer, slot->buf);
+      histAdd(&stats.phase[LOOP_ENCODE], nowNs() - encodeStart);
+      if (recordPath != NULL)
+      {
+        recordOutput(&record, slot->buf, frameBytes, nowNs());
+      }
+      // The overlay is not part of the frame, so it is not recorded
+      frameBytes += statsOverlay(&stats, &renderer, &settings, frames, totalBytes, sched.missed, cleared,
+                                 slot->buf + frameBytes);
+      ringPublish(&ring, frameBytes, renderer.deltaFrames == deltaFrames, cleared);
+      rendererPresented(&renderer);
+      frames++;
+      totalBytes += frameBytes;
+    }
+
+    // Trade color depth and frame rate for bandwidth when needed, unless
+    // the idle rate is in effect anyway
+    if (idleUpdate(&idle, &ring))
+    {
+      idleApply(&idle, &sched, &quality);
+    }
+    if (adaptive && !idle.reasons && controllerUpdate(&quality, totalBytes, &ring))
+    {
+      QualityStep *step = &quality.steps[quality.current];
+      buildCellTable(scene.palette, scene.palettes, step->depth, mode, &cellTable);
+      rendererInvalidate(&renderer); // The screen still shows the old colors
+      schedulerSetRate(&sched, step->fps);
+      cacheRelease(&cache);
+    }
+
+    // Wait for the next deadline, reacting to input and signals at once.
+    // Nothing runs between frames unless a key or signal arrives; a late
+    // frame still checks for input once without blocking. In the
+    // background stdin is left alone, since reading it would stop the
+    // process, and each round checks whether the terminal is back: 'fg'
+    // does not send SIGCONT to a job that was started with '&'.
+    long long remaining = schedulerRemaining(&sched);
+    do
+    {
+      if (remaining < 0)
+      {
+        remaining = 0;
+      }
+      struct timespec timeout = {remaining / 1000000000LL, remaining % 1000000000LL};
+      int paused = idle.reasons & IDLE_BACKGROUND;
+      fds[0].fd = interactive && !paused ? STDIN_FILENO : -1;
+      if (ppoll(fds, 2, &timeout, NULL) == -1)
+      {
+        if (errno != EINTR)
+        {
+          perror("ppoll failed");
+          quit = 1;
+        }
+        continue;
+      }
+      long long inputStart = nowNs();
+      int stopped = 0, continued = 0;
+      if (fds[0].revents & POLLIN)
+      {
+        int events = handleInput(&stats.overlay, &settings);
+        quit |= events & INPUT_QUIT;
+        stopped = events & INPUT_SUSPEND;
+        if (idleInput(&idle, events))
+        {
+          idleApply(&idle, &sched, &quality);
+        }
+      }
+      else if (fds[0].revents & (POLLHUP | POLLERR))
+      {
+        quit = 1; // Terminal went away
+      }
+      if (fds[1].revents & POLLIN)
+      {
+        quit |= handleSignals(sigFd, &resized, &stopped, &continued);
+      }
+      if (stopped && !quit)
+      {
+        suspendProcess(&ring);
+        quit |= handleSignals(sigFd, &resized, &stopped, &continued); // The SIGCONT that woke it
+        continued = 1;
+      }
+      if (continued || (paused && inForeground()))
+      {
+        // The shell used the terminal meanwhile, so repaint once it is ours
+        idle.stops += continued;
+        if (idleSet(&idle, IDLE_BACKGROUND, !resumeTerminal()))
+        {
+          idleApply(&idle, &sched, &quality);
+        }
+        rendererInvalidate(&renderer);
+        renderer.clearScreen = 1;
+        schedulerRestart(&sched);
+      }
+      histAdd(&stats.phase[LOOP_INPUT], nowNs() - inputStart);
+    } while (!quit && (remaining = schedulerRemaining(&sched)) > 0);
+    int steps = schedulerAdvance(&sched);
+    if (cache.frames > 0)
+    {
+      // Skipped slots skip frames; at the idle rate the turn follows the clock
+      cacheIndex = idle.reasons ? cacheFrameAt(&cache, (nowNs() - startTime) * 1e-9 * speedFactor)
+                                : (cacheIndex + steps) % cache.frames;
+    }
+  }
+
+  // The terminal may share the file with stdin and stderr, so restore it
+  // before anything else is printed
+  ringStop(&ring);
+  fcntl(STDOUT_FILENO, F_SETFL, stdoutFlags);
+  if (recordPath != NULL && recordClose(&record) == -1)
+  {
+    fprintf(stderr, "Warning: Recording to '%s' is incomplete: %s\n", recordPath, strerror(errno));
+  }
+
+  if (showStats && frames > 0)
+  {
+    fprintf(stderr, "Frames: %lu (%lu delta), bytes/frame: %.0f avg, %zu last\n",
+            frames, renderer.deltaFrames, (double)totalBytes / frames, frameBytes);
+    if (engine == ENGINE_RAYCAST)
+    {
+      // Rays are only cast inside the boxes of the tori on screen
+      fprintf(stderr, "Rasterizer: raycast (%s), %.0f rays/frame avg, %.1f us/frame avg\n",
+              renderer.ray == rayScalar ? "scalar" : "avx2",
+              renderer.rasterized ? (double)renderer.samples / renderer.rasterized : 0, rasterNs / 1000.0 / frames);
+    }
+    else
+    {
+      fprintf(stderr, "Rasterizer: %s, %d samples, %.1f us/frame avg\n", kernel->name, torus.count,
+              rasterNs / 1000.0 / frames);
+    }
+    fprintf(stderr, "Samples: %llu, %.1f%% passed the depth test\n", renderer.samples,
+            renderer.samples ? 100.0 * renderer.passes / renderer.samples : 0);
+    if (scene.count > 1)
+    {
+      fprintf(stderr, "Scene: %d tori, %.1f on screen per frame avg\n", scene.count,
+              renderer.rasterized ? (double)renderer.instances / renderer.rasterized : 0);
+    }
+    statsPrint(stderr, &stats);
+    fprintf(stderr, "Deadlines missed: %lu, frames skipped: %lu\n", sched.missed, sched.skipped);
+    fprintf(stderr, "Writer: %lu would-block writes, %lu frames superseded, %lu dropped\n",
+            atomic_load(&ring.eagain), atomic_load(&ring.superseded), ring.dropped);
+    long long idleNs = idle.idleNs + (idle.reasons ? nowNs() - idle.since : 0);
+    if (idleNs > 0 || idle.stops > 0)
+    {
+      fprintf(stderr, "Idle: %.1f s at %d fps or paused, %lu focus losses, %lu backlogs, %lu stops%s\n",
+              idleNs * 1e-9, IDLE_FPS, idle.focusLosses, idle.backlogs, idle.stops,
+              idle.reasons & IDLE_REDIRECTED ? ", output redirected" : "");
+    }
+    if (adaptive)
+    {
+      QualityStep *step = &quality.steps[quality.current];
+      fprintf(stderr, "Quality: %s colors, %.1f fps, %lu steps down, %lu up\n", depthNames[step->depth],
+              step->fps, quality.stepsDown, quality.stepsUp);
+    }
+    if (recordPath != NULL)
+    {
+      fprintf(stderr, "Recording: %lu frames (%lu dropped), %.1f MB to %s\n", record.frames, record.dropped,
+              record.bytes / 1e6, recordPath);
+    }
+    if (shm.header != NULL)
+    {
+      fprintf(stderr, "Shared memory: %llu frames published to /dev/shm%s\n",
+              (unsigned long long)shm.published, shm.path);
+    }
+    if (cache.frames > 0)
+    {
+      fprintf(stderr, "Cache: %d frames, %.0f KB, ", cache.frames, cache.dataSize / 1024.0);
+      if (cache.map != NULL)
+      {
+        fprintf(stderr, "mapped from %s\n", cachePath);
+      }
+      else
+      {
+        fprintf(stderr, "built in %.1f ms\n", cache.buildNs / 1e6);
+      }
+    }
+  }
+  if (statsJson != NULL &&
+      statsWriteJson(statsJson, &stats, &renderer, &ring, &sched, frames, totalBytes) == -1)
+  {
+    fprintf(stderr, "Warning: Could not write statistics to '%s': %s\n", statsJson, strerror(errno));
   }
+  cacheRelease(&cache);
+  shmRingClose(&shm);
+  poolStop(&pool);
+  free(renderer.frame.arena);
+  freeTorusGeometry(&torus);
+  close(sigFd);
 
   // Terminal mode is automatically restored by atexit(disableRawMode)
   return 0;
@@ -0,0 +1,158 @@
+// Layout of the frame ring that `donut --shm NAME` publishes in /dev/shm,
+// and a reader for it. Header only, so other programs just include it:
+//
+//   DonutShmReader reader;
+//   DonutShmFrame frame;
+//   if (donutShmOpen(&reader, "donut") == 0)
+//   {
+//     if (donutShmLatest(&reader, &frame) && ... read frame.glyph/lum ... &&
+//         donutShmValid(&frame))
+//     {
+//       // What was read is consistent; otherwise read again
+//     }
+//     donutShmClose(&reader);
+//   }
+//
+// The writer never waits for readers. Every slot has a sequence counter
+// that is odd while the slot is written (seqlock), so readers use the data
+// in place and check afterwards that the counter did not move. The ring has
+// DONUT_SHM_SLOTS slots, so a reader has that many frame periods minus one
+// before the slot it reads is reused.
+#ifndef DONUT_SHM_H
+#define DONUT_SHM_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>    // For O_RDONLY
+#include <unistd.h>   // For close
+#include <sys/mman.h> // For shm_open and mmap
+#include <sys/stat.h> // For fstat
+
+#define DONUT_SHM_MAGIC "DONUTSH1"
+#define DONUT_SHM_VERSION 1
+#define DONUT_SHM_SLOTS 4
+#define DONUT_SHM_MAX_COLS 512 // Larger terminals are published cropped
+#define DONUT_SHM_MAX_ROWS 256
+#define DONUT_SHM_MAX_SUB 8    // Raster points per cell, at most (braille: 2x4)
+#define DONUT_SHM_EMPTY 0xFF   // Luminance of raster points without a sample
+
+// Start of the file. The writer fills in magic last, so a reader that sees
+// it also sees the rest.
+typedef struct
+{
+  char magic[8];           // DONUT_SHM_MAGIC
+  uint32_t version;        // DONUT_SHM_VERSION
+  uint32_t slots;          // DONUT_SHM_SLOTS
+  uint64_t headerSize;     // Offset of slot 0
+  uint64_t slotSize;       // Slot k starts at headerSize + k * slotSize
+  uint64_t glyphOffset;    // Offsets of the grids within a slot
+  uint64_t lumOffset;
+  uint32_t pid;            // Writer process
+  uint32_t reserved;
+  _Atomic uint64_t latest; // Number of the newest complete frame plus one, 0 before the first
+} DonutShmHeader;
+
+// Frame n lives in slot n % slots. Its grids follow at glyphOffset (one
+// Unicode code point per cell, row after row) and lumOffset (luminance
+// 0..11 or DONUT_SHM_EMPTY per raster point, rasterWidth per row).
+typedef struct
+{
+  _Atomic uint64_t seq;             // 2n + 1 while frame n is written, 2n + 2 once complete
+  int64_t timeNs;                   // CLOCK_MONOTONIC time the frame was rendered at
+  uint32_t width, height;           // Cells
+  uint32_t rasterWidth, rasterHeight; // Raster points, a whole number per cell
+  uint32_t mode;                    // 0: cells, 1: half blocks, 2: braille
+  uint32_t reserved;
+} DonutShmSlot;
+
+typedef struct
+{
+  const DonutShmHeader *header; // Mapped file, or NULL
+  size_t size;
+} DonutShmReader;
+
+// The frame a reader looks at, valid until donutShmValid() says otherwise
+typedef struct
+{
+  const DonutShmSlot *slot;
+  uint64_t seq;          // Counter of the slot when the frame was picked
+  uint64_t number;       // Frame number
+  const uint32_t *glyph; // width * height code points
+  const uint8_t *lum;    // rasterWidth * rasterHeight luminance values
+} DonutShmFrame;
+
+// Maps the ring published as NAME (shm_open() name, with or without the
+// leading slash). Returns 0, or -1 if it does not exist or does not match.
+static inline int donutShmOpen(DonutShmReader *r, const char *name)
+{
+  char path[256] = "/";
+  strncat(path, name + (name[0] == '/'), sizeof(path) - 2);
+  r->header = NULL;
+  int fd = shm_open(path, O_RDONLY, 0);
+  if (fd == -1)
+  {
+    return -1;
+  }
+  struct stat st;
+  void *map = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(DonutShmHeader))
+  {
+    map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  }
+  close(fd);
+  if (map == MAP_FAILED)
+  {
+    return -1;
+  }
+  const DonutShmHeader *h = map;
+  if (memcmp(h->magic, DONUT_SHM_MAGIC, 8) != 0 || h->version != DONUT_SHM_VERSION ||
+      h->headerSize + h->slots * h->slotSize > (uint64_t)st.st_size)
+  {
+    munmap(map, (size_t)st.st_size);
+    return -1;
+  }
+  atomic_thread_fence(memory_order_acquire); // Pairs with the writer's release before the magic
+  r->header = h;
+  r->size = (size_t)st.st_size;
+  return 0;
+}
+
+static inline void donutShmClose(DonutShmReader *r)
+{
+  if (r->header != NULL)
+  {
+    munmap((void *)r->header, r->size);
+    r->header = NULL;
+  }
+}
+
+// Picks the newest complete frame. Returns 1, or 0 if there is none yet or
+// the writer is just overwriting it (try again).
+static inline int donutShmLatest(const DonutShmReader *r, DonutShmFrame *f)
+{
+  const DonutShmHeader *h = r->header;
+  uint64_t latest = atomic_load_explicit(&((DonutShmHeader *)h)->latest, memory_order_acquire);
+  if (latest == 0)
+  {
+    return 0;
+  }
+  const char *slot = (const char *)h + h->headerSize + (latest - 1) % h->slots * h->slotSize;
+  f->slot = (const DonutShmSlot *)slot;
+  f->seq = atomic_load_explicit(&((DonutShmSlot *)f->slot)->seq, memory_order_acquire);
+  f->number = f->seq / 2 - 1;
+  f->glyph = (const uint32_t *)(slot + h->glyphOffset);
+  f->lum = (const uint8_t *)(slot + h->lumOffset);
+  return (f->seq & 1) == 0 && f->seq != 0;
+}
+
+// Returns 1 if the frame was not touched by the writer since
+// donutShmLatest() picked it, so everything read from it in between is
+// consistent
+static inline int donutShmValid(const DonutShmFrame *f)
+{
+  atomic_thread_fence(memory_order_acquire);
+  return atomic_load_explicit(&((DonutShmSlot *)f->slot)->seq, memory_order_relaxed) == f->seq;
+}
+
+#endif